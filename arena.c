@@ -0,0 +1,132 @@
+#include "server.h"
+
+/**
+ * Scratch memory for parsing and building replies. Strings read from a
+ * message, userinfo values and formatted text are carved off the end of
+ * a per-thread block and all thrown away at once when the message is
+ * done, so nothing on the parse path needs to malloc, free or share a
+ * static buffer.
+ *
+ * Blocks are chained when one fills up and are kept for next time, so a
+ * thread only allocates while its arena is growing to the biggest message
+ * it has seen.
+ */
+
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    size_t      size;       // room in data
+    byte        data[];
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *first;
+    arena_block_t *current;
+    size_t      used;       // of current
+    void        *last;      // most recent allocation, can be shrunk
+} arena_t;
+
+static __thread arena_t arena;
+
+
+/**
+ * Move on to the next block in the chain that fits len, adding one if
+ * none do
+ */
+static void next_block(size_t len)
+{
+    arena_block_t *b, **link;
+    size_t size;
+
+    link = (arena.current) ? &arena.current->next : &arena.first;
+
+    while ((b = *link)) {
+        if (b->size >= len) {
+            break;
+        }
+        link = &b->next;
+    }
+
+    if (!b) {
+        size = (len > ARENA_BLOCK - sizeof(arena_block_t)) ? len : ARENA_BLOCK - sizeof(arena_block_t);
+        b = malloc(sizeof(arena_block_t) + size);
+        b->next = NULL;
+        b->size = size;
+        *link = b;
+    }
+
+    arena.current = b;
+    arena.used = 0;
+}
+
+
+/**
+ * Get len bytes that last until the next ARENA_Reset() past this point
+ */
+void *ARENA_Alloc(size_t len)
+{
+    void *p;
+
+    len = (len + 7) & ~7;
+
+    if (!arena.current || arena.used + len > arena.current->size) {
+        next_block(len);
+    }
+
+    p = arena.current->data + arena.used;
+    arena.used += len;
+    arena.last = p;
+
+    return p;
+}
+
+
+/**
+ * Give back the end of the most recent allocation once it's known how
+ * much of it was needed
+ */
+void ARENA_Shrink(void *p, size_t len)
+{
+    if (p != arena.last) {
+        return;
+    }
+
+    len = (len + 7) & ~7;
+    arena.used = ((byte *) p - arena.current->data) + len;
+}
+
+
+/**
+ * Copy a string into the arena
+ */
+char *ARENA_Strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return memcpy(ARENA_Alloc(len), str, len);
+}
+
+
+/**
+ * Remember where the arena is, everything allocated after this goes away
+ * when it's passed to ARENA_Reset()
+ */
+arena_mark_t ARENA_Mark(void)
+{
+    arena_mark_t m;
+
+    m.block = arena.current;
+    m.used = arena.used;
+
+    return m;
+}
+
+
+/**
+ * Free everything allocated since the mark
+ */
+void ARENA_Reset(arena_mark_t m)
+{
+    arena.current = m.block;
+    arena.used = m.used;
+    arena.last = NULL;
+}
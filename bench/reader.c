@@ -0,0 +1,154 @@
+#include "../server.h"
+
+/**
+ * Decoding a message of hellos three ways: the old readers that shifted a
+ * byte at a time with no length checks, MSG_Read*() checking each field,
+ * and one MSG_ReadSpan() for the whole fixed layout the way ParseHello()
+ * does it. Last, the same message cut short, to show what rejecting a
+ * bad one costs.
+ */
+
+server_info_t *registry;
+uint32_t registry_count;
+
+#define COMMANDS    256
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the way msg.c used to read, kept out of line like they were there
+__attribute__((noinline)) static uint8_t old_ReadByte(msg_buffer_t *msg)
+{
+    return msg->data[msg->index++];
+}
+
+__attribute__((noinline)) static uint16_t old_ReadShort(msg_buffer_t *msg)
+{
+    uint16_t v = msg->data[msg->index];
+
+    v += msg->data[msg->index + 1] << 8;
+    msg->index += 2;
+    return v;
+}
+
+__attribute__((noinline)) static int32_t old_ReadLong(msg_buffer_t *msg)
+{
+    int32_t v = msg->data[msg->index];
+
+    v += msg->data[msg->index + 1] << 8;
+    v += msg->data[msg->index + 2] << 16;
+    v += msg->data[msg->index + 3] << 24;
+    msg->index += 4;
+    return v;
+}
+
+__attribute__((noinline)) static void old_ReadData(msg_buffer_t *msg, void *out, size_t len)
+{
+    memcpy(out, &(msg->data[msg->index]), len);
+    msg->index += len;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rounds = (argc > 1) ? atoi(argv[1]) : 20000;
+    uint32_t i, r, rejected = 0;
+    msg_buffer_t msg;
+    byte challenge[CHALLENGE_LEN];
+    const byte *p;
+    size_t length;
+    uint64_t start, total = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(challenge, 0x5a, sizeof(challenge));
+    for (i=0; i<COMMANDS; i++) {
+        MSG_WriteByte(CMD_HELLO, &msg);
+        MSG_WriteLong(0x12345678 + i, &msg);
+        MSG_WriteLong(i, &msg);
+        MSG_WriteShort(27910 + i, &msg);
+        MSG_WriteByte(1, &msg);
+        MSG_WriteByte(i & 0xff, &msg);
+        MSG_WriteData(challenge, sizeof(challenge), &msg);
+    }
+    length = msg.length;
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        msg.index = 0;
+        for (i=0; i<COMMANDS; i++) {
+            total += old_ReadByte(&msg);
+            total += old_ReadLong(&msg);
+            total += old_ReadLong(&msg);
+            total += old_ReadShort(&msg);
+            total += old_ReadByte(&msg);
+            total += old_ReadByte(&msg);
+            old_ReadData(&msg, challenge, sizeof(challenge));
+            total += challenge[0];
+        }
+    }
+    printf("bytewise: %5.1f ns per command\n", (double) (now_ns() - start) / rounds / COMMANDS);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        msg.index = 0;
+        for (i=0; i<COMMANDS; i++) {
+            total += MSG_ReadByte(&msg);
+            total += MSG_ReadLong(&msg);
+            total += MSG_ReadLong(&msg);
+            total += MSG_ReadShort(&msg);
+            total += MSG_ReadByte(&msg);
+            total += MSG_ReadByte(&msg);
+            MSG_ReadData(&msg, challenge, sizeof(challenge));
+            total += challenge[0];
+        }
+    }
+    printf("checked:  %5.1f ns per command\n", (double) (now_ns() - start) / rounds / COMMANDS);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        msg.index = 0;
+        for (i=0; i<COMMANDS; i++) {
+            total += MSG_ReadByte(&msg);
+            p = MSG_ReadSpan(&msg, HELLO_LEN);
+            if (!p) {
+                break;
+            }
+            total += LittleLong(p);
+            total += LittleLong(p + 4);
+            total += LittleShort(p + 8);
+            total += p[10];
+            total += p[11];
+            memcpy(challenge, p + 12, CHALLENGE_LEN);
+            total += challenge[0];
+        }
+    }
+    printf("span:     %5.1f ns per command\n", (double) (now_ns() - start) / rounds / COMMANDS);
+
+    // ends in the middle of the first command's challenge
+    msg.length = 20;
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        msg.index = 0;
+        msg.overflowed = false;
+        for (i=0; i<COMMANDS && !msg.overflowed; i++) {
+            total += MSG_ReadByte(&msg);
+            total += MSG_ReadLong(&msg);
+            total += MSG_ReadLong(&msg);
+            total += MSG_ReadShort(&msg);
+            total += MSG_ReadByte(&msg);
+            total += MSG_ReadByte(&msg);
+            MSG_ReadData(&msg, challenge, sizeof(challenge));
+        }
+        rejected += msg.overflowed;
+    }
+    printf("short:    %5.1f ns to reject (%u of %u)\n", (double) (now_ns() - start) / rounds, rejected, rounds);
+
+    msg.length = length;
+    MSG_Release(&msg);
+
+    return (total == 0);
+}
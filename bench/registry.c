@@ -0,0 +1,64 @@
+#include "../server.h"
+
+/**
+ * Walking every server: the registry array against following a pointer to
+ * each server's own (much bigger) structure, the way the old linked list
+ * did. Run with the number of servers, 10000 by default.
+ */
+
+server_info_t *registry;
+uint32_t registry_count;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = (argc > 1) ? atoi(argv[1]) : 10000;
+    uint32_t rounds = 1000, i, r;
+    q2_server_t **servers;
+    server_info_t *s;
+    uint64_t start, total = 0;
+
+    registry = calloc(count, sizeof(server_info_t));
+    servers = malloc(count * sizeof(q2_server_t *));
+    registry_count = count;
+
+    for (i=0; i<count; i++) {
+        servers[i] = calloc(1, sizeof(q2_server_t));
+        servers[i]->connected = servers[i]->trusted = (i % 3 != 0);
+        servers[i]->playercount = i & 15;
+        registry[i].connected = registry[i].trusted = servers[i]->trusted;
+        registry[i].playercount = servers[i]->playercount;
+        registry[i].server = servers[i];
+    }
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        __asm__ __volatile__("" ::: "memory");
+        for (i=0; i<count; i++) {
+            if (servers[i]->connected && servers[i]->trusted) {
+                total += servers[i]->playercount;
+            }
+        }
+    }
+    printf("servers:  %6.1f ns per walk of %u\n", (double) (now_ns() - start) / rounds, count);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        __asm__ __volatile__("" ::: "memory");
+        FOR_EACH_SERVER(s) {
+            if (s->connected && s->trusted) {
+                total += s->playercount;
+            }
+        }
+    }
+    printf("registry: %6.1f ns per walk of %u\n", (double) (now_ns() - start) / rounds, count);
+
+    return (total == 0);
+}
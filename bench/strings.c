@@ -0,0 +1,60 @@
+#include "../server.h"
+
+/**
+ * Reading the strings out of a message: copied into the arena with
+ * MSG_ReadString() against borrowed in place with MSG_ReadStringView().
+ * The message holds a mix of short commands and userinfo strings.
+ */
+
+server_info_t *registry;
+uint32_t registry_count;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rounds = (argc > 1) ? atoi(argv[1]) : 100000;
+    uint32_t strings = 0, i, r;
+    msg_buffer_t msg;
+    msg_string_t view;
+    arena_mark_t mark;
+    uint64_t start, total = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    for (i=0; i<32; i++) {
+        MSG_WriteString("q2dm1", &msg);
+        MSG_WriteString("\\name\\someplayer\\skin\\male/grunt\\hand\\2\\fov\\90\\rate\\25000\\msg\\1", &msg);
+        strings += 2;
+    }
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        mark = ARENA_Mark();
+        msg.index = 0;
+        for (i=0; i<strings; i++) {
+            total += MSG_ReadString(&msg)[0];
+        }
+        ARENA_Reset(mark);
+    }
+    printf("copied:   %5.1f ns per string\n", (double) (now_ns() - start) / rounds / strings);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        msg.index = 0;
+        for (i=0; i<strings; i++) {
+            view = MSG_ReadStringView(&msg);
+            total += view.len;
+        }
+    }
+    printf("borrowed: %5.1f ns per string\n", (double) (now_ns() - start) / rounds / strings);
+
+    MSG_Release(&msg);
+
+    return (total == 0);
+}
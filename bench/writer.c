@@ -0,0 +1,118 @@
+#include "../server.h"
+
+/**
+ * Serializing output: the old writers that copied a byte at a time into
+ * a fixed array, updating index and length for every byte, against
+ * MSG_WriteSpan() with one capacity check and a memcpy per write. Two
+ * payloads, a broadcast copied to one server after another and a 100
+ * line teleport listing written as client text.
+ */
+
+server_info_t *registry;
+uint32_t registry_count;
+
+#define SERVERS     64
+#define LINES       100
+
+typedef struct {
+    size_t      length;
+    uint32_t    index;
+    byte        data[0xffff];
+} old_buffer_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the way msg.c used to write, kept out of line like they were there
+__attribute__((noinline)) static void old_WriteByte(byte b, old_buffer_t *buf)
+{
+    buf->data[buf->index] = b;
+    buf->index++;
+    buf->length++;
+}
+
+__attribute__((noinline)) static void old_WriteData(const void *data, size_t length, old_buffer_t *buf)
+{
+    uint32_t i;
+
+    for (i=0; i<length; i++) {
+        old_WriteByte(((byte *) data)[i], buf);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rounds = (argc > 1) ? atoi(argv[1]) : 2000;
+    uint32_t i, r;
+    static old_buffer_t old;
+    msg_buffer_t msg, bc;
+    char line[100];
+    size_t len;
+    uint64_t start, total = 0;
+
+    memset(&bc, 0, sizeof(bc));
+    MSG_WriteByte(SCMD_SAYALL, &bc);
+    MSG_WriteString("someplayer invites you to play on Some Server Name: 2v2 on q2dm1, need one more", &bc);
+
+    snprintf(line, sizeof(line), "%-17s %s (%d/%d) %s\n", "Some Server Name", "q2dm1", 3, 16, "alice, bob, carol");
+    len = strlen(line);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        for (i=0; i<SERVERS; i++) {
+            old.index = old.length = 0;
+            old_WriteData(bc.data, bc.length, &old);
+            total += old.length;
+        }
+    }
+    printf("broadcast, bytewise: %6.1f ns per server\n", (double) (now_ns() - start) / rounds / SERVERS);
+
+    memset(&msg, 0, sizeof(msg));
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        for (i=0; i<SERVERS; i++) {
+            msg.index = msg.length = 0;
+            MSG_WriteData(bc.data, bc.length, &msg);
+            total += msg.length;
+        }
+    }
+    printf("broadcast, span:     %6.1f ns per server\n", (double) (now_ns() - start) / rounds / SERVERS);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        old.index = old.length = 0;
+        old_WriteByte(SCMD_SAYCLIENT, &old);
+        old_WriteByte(0, &old);
+        old_WriteByte(PRINT_HIGH, &old);
+        for (i=0; i<LINES; i++) {
+            old_WriteData(line, len, &old);
+        }
+        old_WriteByte(0, &old);
+        total += old.length;
+    }
+    printf("listing, bytewise:   %6.1f us per listing\n", (double) (now_ns() - start) / rounds / 1000);
+
+    start = now_ns();
+    for (r=0; r<rounds; r++) {
+        msg.index = msg.length = 0;
+        MSG_WriteByte(SCMD_SAYCLIENT, &msg);
+        MSG_WriteByte(0, &msg);
+        MSG_WriteByte(PRINT_HIGH, &msg);
+        for (i=0; i<LINES; i++) {
+            MSG_WriteData(line, len, &msg);
+        }
+        MSG_WriteByte(0, &msg);
+        total += msg.length;
+    }
+    printf("listing, span:       %6.1f us per listing\n", (double) (now_ns() - start) / rounds / 1000);
+
+    MSG_Release(&msg);
+    MSG_Release(&bc);
+
+    return (total == 0);
+}
@@ -0,0 +1,129 @@
+#include "server.h"
+
+/**
+ * Sending the same thing to every server. The message is serialized once
+ * and the copy is shared by all reactors. Each reactor appends it to its
+ * own servers' buffers and sends them right away, so the encryption for
+ * each connection happens on the thread that owns it, all reactors at
+ * once. The last reactor to finish reports how long the whole thing took.
+ */
+
+typedef struct broadcast_s broadcast_t;
+
+/**
+ * One reactor's share of a broadcast
+ */
+typedef struct {
+    broadcast_t *bc;
+    reactor_t   *reactor;
+} bc_part_t;
+
+struct broadcast_s {
+    reactor_t   *origin;        // where it came from, gets the stats
+    uint32_t    refs;           // reactors still working on it
+    uint32_t    servers;        // how many it went to
+    uint64_t    started;        // us
+    bc_part_t   parts[MAX_REACTORS];
+    size_t      length;
+    byte        data[];
+};
+
+
+/**
+ * Send a broadcast to every trusted server owned by one reactor. Runs on
+ * that reactor's thread.
+ */
+static void BroadcastPart(void *arg)
+{
+    bc_part_t *part = arg;
+    broadcast_t *bc = part->bc;
+    reactor_t *r = part->reactor;
+    q2_server_t *s, *next;
+    uint32_t count = 0;
+    uint64_t elapsed;
+
+    FOR_EACH_REACTOR_SERVER_SAFE(r, s, next) {
+        if (!s->trusted) {
+            continue;
+        }
+
+        MSG_WriteData(bc->data, bc->length, &s->msg);
+        SendBuffer(s);
+        count++;
+    }
+
+    // don't wait for the end of the loop iteration
+    FlushBuffers(r);
+
+    __atomic_add_fetch(&bc->servers, count, __ATOMIC_RELAXED);
+
+    if (__atomic_sub_fetch(&bc->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    elapsed = Microseconds() - bc->started;
+
+    __atomic_add_fetch(&bc->origin->broadcasts, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bc->origin->fanout_total, elapsed, __ATOMIC_RELAXED);
+    if (elapsed > __atomic_load_n(&bc->origin->fanout_peak, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&bc->origin->fanout_peak, elapsed, __ATOMIC_RELAXED);
+    }
+
+    if (config.debug) {
+        printf("broadcast of %zu bytes reached %u servers in %llu us\n",
+                bc->length, bc->servers, (unsigned long long) elapsed);
+    }
+
+    free(bc);
+}
+
+
+/**
+ * Send a serialized message to every trusted server on every reactor.
+ * Must be called from a reactor thread, that reactor's share is done
+ * before returning.
+ */
+void Broadcast(reactor_t *origin, const byte *data, size_t len)
+{
+    broadcast_t *bc;
+    uint32_t i;
+
+    bc = malloc(sizeof(broadcast_t) + len);
+    bc->origin = origin;
+    bc->refs = config.reactors;
+    bc->servers = 0;
+    bc->started = Microseconds();
+    bc->length = len;
+    memcpy(bc->data, data, len);
+
+    for (i=0; i<config.reactors; i++) {
+        bc->parts[i].bc = bc;
+        bc->parts[i].reactor = &reactors[i];
+    }
+
+    // other reactors' servers are theirs to write to. bc can't be freed
+    // before our share is done, so that goes last
+    for (i=0; i<config.reactors; i++) {
+        if (&reactors[i] != origin) {
+            EV_Post(reactors[i].loop, BroadcastPart, &bc->parts[i]);
+        }
+    }
+
+    BroadcastPart(&bc->parts[origin->id]);
+}
+
+
+/**
+ * Print a line of text on every server
+ */
+void BroadcastSay(reactor_t *origin, const char *text)
+{
+    msg_buffer_t out;
+
+    memset(&out, 0, sizeof(out));
+    MSG_WriteByte(SCMD_SAYALL, &out);
+    MSG_WriteString(text, &out);
+
+    Broadcast(origin, out.data, out.length);
+    MSG_Release(&out);
+}
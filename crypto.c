@@ -27,41 +27,254 @@
  */
 
 
+// our private key, loaded at startup and again on SIGHUP
+static EVP_PKEY *privatekey;
+static pthread_mutex_t keylock = PTHREAD_MUTEX_INITIALIZER;
+
+// set by SIGHUP, the first reactor does the reload
+volatile sig_atomic_t reload_keys;
+
+
 /**
- * Encrypt the client-provided challenge with our private key to authenticate us.
- *
- * length of *to should be the same as the key length or RSA_size() (2048 for us)
+ * (Re)load our private key from config.private_key. If it can't be
+ * loaded the one already in use stays.
  */
-size_t Sign_Client_Challenge(byte *to, byte *from)
+bool LoadPrivateKey(void)
 {
-	RSA *privatekey;
+	EVP_PKEY *key, *old;
 	FILE *fp;
-	size_t cipherlen;
 
 	fp = fopen(config.private_key, "rb");
-
 	if (!fp) {
-	    printf("[error] unable to open private key: %s *\n", config.private_key);
-	    return 0;
+	    printf("[error] unable to open private key: %s\n", config.private_key);
+	    return false;
+	}
+
+	key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+
+	if (!key) {
+	    printf("[error] problems loading private key: %s\n", config.private_key);
+	    return false;
+	}
+
+	// signatures go in RSA_LEN sized buffers
+	if (EVP_PKEY_base_id(key) != EVP_PKEY_RSA || EVP_PKEY_size(key) > RSA_LEN) {
+	    printf("[error] private key must be RSA, at most %d bits: %s\n", RSA_LEN * 8, config.private_key);
+	    EVP_PKEY_free(key);
+	    return false;
 	}
 
-	privatekey = RSA_new();
-	privatekey = PEM_read_RSAPrivateKey(fp, &privatekey, NULL, NULL);
+	pthread_mutex_lock(&keylock);
+	old = privatekey;
+	privatekey = key;
+	pthread_mutex_unlock(&keylock);
+
+	EVP_PKEY_free(old);
+	printf("Loaded private key from '%s'\n", config.private_key);
 
-	if (!privatekey) {
-	    printf("[error] problems loading private key *\n");
+	return true;
+}
+
+
+/**
+ * Encrypt the client-provided challenge with our private key to authenticate us.
+ *
+ * length of *to should be at least RSA_LEN
+ */
+size_t Sign_Client_Challenge(byte *to, byte *from)
+{
+	EVP_PKEY *key;
+	EVP_PKEY_CTX *ctx;
+	size_t cipherlen = RSA_LEN;
+
+	// hold a reference in case of a reload while we're using it
+	pthread_mutex_lock(&keylock);
+	key = privatekey;
+	if (key) {
+	    EVP_PKEY_up_ref(key);
+	}
+	pthread_mutex_unlock(&keylock);
+
+	if (!key) {
+	    printf("[error] no private key loaded\n");
 	    return 0;
 	}
 
-	cipherlen = RSA_private_encrypt(CHALLENGE_LEN, from, to, privatekey, RSA_PKCS1_PADDING);
+	// no digest set, so this pads and encrypts the raw challenge exactly
+	// like RSA_private_encrypt() did
+	ctx = EVP_PKEY_CTX_new(key, NULL);
+	if (!ctx ||
+	        EVP_PKEY_sign_init(ctx) <= 0 ||
+	        EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0 ||
+	        EVP_PKEY_sign(ctx, to, &cipherlen, from, CHALLENGE_LEN) <= 0) {
+	    cipherlen = 0;
+	}
 
-	RSA_free(privatekey);
-	fclose(fp);
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(key);
 
 	return cipherlen;
 }
 
 
+/**
+ * Parsed client public keys, so a server reconnecting doesn't mean reading
+ * and parsing its key file again. An entry is good as long as the file
+ * looks the same (mtime, size, inode), that's checked with a stat() on
+ * every lookup. The least recently used ones are dropped past
+ * config.key_cache entries.
+ */
+typedef struct {
+    uint32_t    key;
+    RSA         *rsa;
+    time_t      mtime;
+    off_t       size;
+    ino_t       inode;
+    list_t      entry;      // in the LRU list, most recent first
+} pubkey_t;
+
+static GHashTable *pubkeys;
+static LIST_DECL(pubkey_lru);
+static uint32_t pubkey_count;
+static pthread_mutex_t pubkeylock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Take a cache entry out, the caller has the lock
+ */
+static void drop_pubkey(pubkey_t *pk)
+{
+    g_hash_table_remove(pubkeys, GUINT_TO_POINTER(pk->key));
+    List_Delete(&pk->entry);
+    RSA_free(pk->rsa);
+    free(pk);
+    pubkey_count--;
+}
+
+
+/**
+ * Get a client's public key, from the cache if the file hasn't changed.
+ * The caller owns a reference, RSA_free() it when done. NULL if there's
+ * no usable key.
+ */
+RSA *GetClientPublicKey(uint32_t key)
+{
+    char filename[200];
+    struct stat st;
+    pubkey_t *pk;
+    RSA *rsa = NULL;
+    FILE *fp;
+
+    snprintf(filename, sizeof(filename), "keys/%u.pem", key);
+
+    pthread_mutex_lock(&pubkeylock);
+
+    if (!pubkeys) {
+        pubkeys = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    pk = g_hash_table_lookup(pubkeys, GUINT_TO_POINTER(key));
+
+    if (stat(filename, &st) == -1) {
+        if (pk) {
+            drop_pubkey(pk);
+        }
+        pthread_mutex_unlock(&pubkeylock);
+        printf("[error] no public key for server %u: %s\n", key, filename);
+        return NULL;
+    }
+
+    if (pk && pk->mtime == st.st_mtime && pk->size == st.st_size && pk->inode == st.st_ino) {
+        List_Delete(&pk->entry);
+        List_Insert(&pubkey_lru, &pk->entry);
+        RSA_up_ref(pk->rsa);
+        pthread_mutex_unlock(&pubkeylock);
+        return pk->rsa;
+    }
+
+    pthread_mutex_unlock(&pubkeylock);
+
+    // parsing is the slow part, don't hold everyone else up
+    fp = fopen(filename, "rb");
+    if (fp) {
+        rsa = PEM_read_RSAPublicKey(fp, NULL, NULL, NULL);
+        fclose(fp);
+    }
+
+    if (!rsa) {
+        printf("[error] problems loading public key for server %u: %s\n", key, filename);
+        return NULL;
+    }
+
+    // everything it encrypts or decrypts goes in RSA_LEN sized buffers
+    if (RSA_size(rsa) > RSA_LEN) {
+        printf("[error] public key for server %u is over %d bits: %s\n", key, RSA_LEN * 8, filename);
+        RSA_free(rsa);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pubkeylock);
+
+    // whatever's there is older than what we just read
+    pk = g_hash_table_lookup(pubkeys, GUINT_TO_POINTER(key));
+    if (pk) {
+        drop_pubkey(pk);
+    }
+
+    while (pubkey_count >= config.key_cache) {
+        drop_pubkey(LIST_LAST(pubkey_t, &pubkey_lru, entry));
+    }
+
+    pk = malloc(sizeof(pubkey_t));
+    pk->key = key;
+    pk->rsa = rsa;
+    pk->mtime = st.st_mtime;
+    pk->size = st.st_size;
+    pk->inode = st.st_ino;
+    List_Insert(&pubkey_lru, &pk->entry);
+    g_hash_table_insert(pubkeys, GUINT_TO_POINTER(key), pk);
+    pubkey_count++;
+    RSA_up_ref(rsa);
+
+    pthread_mutex_unlock(&pubkeylock);
+
+    return rsa;
+}
+
+
+/**
+ * Load one server's key into the cache, runs on the threadpool
+ */
+static void PrewarmKey(void *arg)
+{
+    RSA *rsa = GetClientPublicKey(GPOINTER_TO_UINT(arg));
+
+    if (rsa) {
+        RSA_free(rsa);
+    }
+}
+
+
+/**
+ * Start parsing known servers' public keys in the background, so the
+ * rush of reconnects after a restart finds them ready. Only as many as
+ * the cache holds, any more would just push out the ones parsed first.
+ */
+void PrewarmPublicKeys(void)
+{
+    server_info_t *s;
+    uint32_t count = 0;
+
+    FOR_EACH_SERVER(s) {
+        if (count++ == config.key_cache) {
+            break;
+        }
+        thpool_add_work(pool, PrewarmKey, GUINT_TO_POINTER(s->server->key));
+    }
+}
+
+
 /**
  * This is the symmetric AES key for encrypting messages between client/server.
  * This is only generated if the client indicates it wants encryption.
@@ -89,62 +302,144 @@ size_t Encrypt_AESKey(RSA *publickey, byte *key, byte *iv, byte *cipher)
 
 
 /**
- *
+ * Set up the session's cipher contexts once the client is trusted. The
+ * key schedule is done here and kept for the life of the connection, each
+ * message after this only sets its IV or nonce.
+ */
+bool SymmetricInit(q2_server_t *q2)
+{
+    connection_t *c = &q2->connection;
+    const EVP_CIPHER *cipher;
+
+    cipher = (c->encrypted == CIPHER_GCM) ? EVP_aes_128_gcm() : EVP_aes_128_cbc();
+
+    c->e_ctx = EVP_CIPHER_CTX_new();
+    c->d_ctx = EVP_CIPHER_CTX_new();
+    c->send_seq = 0;
+    c->recv_seq = 0;
+
+    if (!c->e_ctx || !c->d_ctx) {
+        return false;
+    }
+
+    if (!EVP_EncryptInit_ex(c->e_ctx, cipher, NULL, c->aeskey, NULL)) {
+        return false;
+    }
+
+    return EVP_DecryptInit_ex(c->d_ctx, cipher, NULL, c->aeskey, NULL) == 1;
+}
+
+
+/**
+ * The GCM nonce for a message: the first 12 bytes of the session IV with
+ * the message's sequence number xored into the last 8 (little endian).
+ * Each direction counts from 0, server to client messages have the top
+ * bit of the sequence set so the two never use the same nonce.
  */
-size_t SymmetricEncrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len)
+static void gcm_nonce(connection_t *c, uint64_t seq, bool outgoing, byte *nonce)
+{
+    int i;
+
+    if (outgoing) {
+        seq |= NONCE_OUTGOING;
+    }
+
+    memcpy(nonce, c->iv, AEAD_NONCE_LEN);
+    for (i = 0; i < 8; i++) {
+        nonce[AEAD_NONCE_LEN - 8 + i] ^= (seq >> (i * 8)) & 0xff;
+    }
+}
+
+
+/**
+ * Encrypt a message for the q2 server. With GCM the tag is appended, so
+ * dest needs room for src_len + AESBLOCK_LEN either way. dest can be src
+ * to encrypt in place. Returns the length written or -1.
+ */
+ssize_t SymmetricEncrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len)
 {
     connection_t *c = &q2->connection;
-    int dest_len = 0;
+    byte nonce[AEAD_NONCE_LEN];
+    int len = 0;
     int written = 0;
 
-    if (!(c || c->e_ctx)) {
-        return 0;
+    if (!c->e_ctx) {
+        return -1;
+    }
+
+    if (c->encrypted == CIPHER_GCM) {
+        gcm_nonce(c, c->send_seq++, true, nonce);
+        if (!EVP_EncryptInit_ex(c->e_ctx, NULL, NULL, NULL, nonce)) {
+            return -1;
+        }
+    } else if (!EVP_EncryptInit_ex(c->e_ctx, NULL, NULL, NULL, c->iv)) {
+        return -1;
     }
 
-    EVP_EncryptInit_ex(
-            q2->connection.e_ctx,
-            EVP_aes_128_cbc(),
-            NULL,
-            q2->connection.aeskey,
-            q2->connection.iv
-    );
+    if (!EVP_EncryptUpdate(c->e_ctx, dest, &len, src, src_len)) {
+        return -1;
+    }
+    written += len;
 
-    EVP_EncryptUpdate(c->e_ctx, dest + dest_len, &dest_len, src, src_len);
-    written += dest_len;
+    if (!EVP_EncryptFinal_ex(c->e_ctx, dest + written, &len)) {
+        return -1;
+    }
+    written += len;
 
-    EVP_EncryptFinal_ex(c->e_ctx, dest + dest_len, &dest_len);
-    written += dest_len;
+    if (c->encrypted == CIPHER_GCM) {
+        if (!EVP_CIPHER_CTX_ctrl(c->e_ctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LEN, dest + written)) {
+            return -1;
+        }
+        written += AEAD_TAG_LEN;
+    }
 
     return written;
 }
 
+
 /**
- *
+ * Decrypt a message from the q2 server. Returns the plaintext length, or
+ * -1 if it can't be decrypted (bad padding, or with GCM a tag that doesn't
+ * match, meaning it was tampered with or is out of sequence). dest can
+ * be src to decrypt in place.
  */
-size_t SymmetricDecrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len)
+ssize_t SymmetricDecrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len)
 {
     connection_t *c = &q2->connection;
-    int dest_len = 0;
+    byte nonce[AEAD_NONCE_LEN];
+    int len = 0;
     int written = 0;
 
-    if (!(c || c->d_ctx)) {
-        return 0;
+    if (!c->d_ctx) {
+        return -1;
     }
 
-    EVP_DecryptInit_ex (
-            c->d_ctx,
-            EVP_aes_128_cbc(),
-            NULL,
-            c->aeskey,
-            c->iv
-    );
+    if (c->encrypted == CIPHER_GCM) {
+        if (src_len < AEAD_TAG_LEN) {
+            return -1;
+        }
+        src_len -= AEAD_TAG_LEN;
 
-    EVP_DecryptUpdate(c->d_ctx, dest + dest_len, &dest_len, src, src_len);
-    written += dest_len;
+        gcm_nonce(c, c->recv_seq++, false, nonce);
+        if (!EVP_DecryptInit_ex(c->d_ctx, NULL, NULL, NULL, nonce)) {
+            return -1;
+        }
+        if (!EVP_CIPHER_CTX_ctrl(c->d_ctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LEN, src + src_len)) {
+            return -1;
+        }
+    } else if (!EVP_DecryptInit_ex(c->d_ctx, NULL, NULL, NULL, c->iv)) {
+        return -1;
+    }
 
-    EVP_DecryptFinal_ex(c->d_ctx, dest + dest_len, &dest_len);
-    written += dest_len;
+    if (!EVP_DecryptUpdate(c->d_ctx, dest, &len, src, src_len)) {
+        return -1;
+    }
+    written += len;
+
+    if (EVP_DecryptFinal_ex(c->d_ctx, dest + written, &len) <= 0) {
+        return -1;
+    }
+    written += len;
 
     return written;
 }
-
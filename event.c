@@ -0,0 +1,628 @@
+#include "server.h"
+
+/**
+ * Event loop backends. Each socket is registered along with a pointer to
+ * the connection that owns it, and that pointer is handed back when the
+ * socket becomes ready, so dispatch never has to search for the server.
+ *
+ * epoll is used on Linux, poll() is the portable fallback. Pick with
+ * CONFIG_POLL in .config. With CONFIG_IO_URING the loop uses io_uring
+ * when the kernel supports it (see uring.c) and one of the others when
+ * it doesn't.
+ */
+
+/**
+ * A function to run on a loop's own thread, see EV_Post()
+ */
+typedef struct ev_job_s {
+    void            (*func)(void *arg);
+    void            *arg;
+    struct ev_job_s *next;
+} ev_job_t;
+
+struct ev_loop_s {
+    int             wakeup[2];      // [0] is watched by the loop, posters write [1]
+    pthread_mutex_t joblock;
+    ev_job_t        *jobs;
+    ev_job_t        *lastjob;
+    ev_event_t      *batch;         // events handed out by the last EV_Wait()
+    int             batch_count;
+#if USE_IO_URING
+    uring_t         *uring;
+#endif
+#if USE_EPOLL
+    int             epfd;
+    struct epoll_event events[EV_MAXEVENTS];
+    void            **data;         // connection for each socket, indexed by fd
+    uint32_t        data_size;
+#else
+    struct pollfd   *fds;           // kept dense, handed straight to poll()
+    void            **data;
+    uint32_t        count;
+    uint32_t        size;
+    int             *slots;         // position in fds for each socket, -1 if none
+    uint32_t        slots_size;
+#endif
+};
+
+
+#if USE_EPOLL
+
+static uint32_t ev_to_epoll(uint32_t events)
+{
+    uint32_t e = 0;
+
+    if (events & EV_ACCEPT) {
+        e |= EPOLLIN;
+    }
+
+    if (events & EV_READ) {
+        e |= EPOLLIN | EPOLLRDHUP;
+    }
+
+    if (events & EV_WRITE) {
+        e |= EPOLLOUT;
+    }
+
+    if (events & EV_EDGE) {
+        e |= EPOLLET;
+    }
+
+    return e;
+}
+
+static ev_loop_t *backend_create(void)
+{
+    ev_loop_t *ev;
+
+    ev = malloc(sizeof(ev_loop_t));
+    memset(ev, 0, sizeof(ev_loop_t));
+
+    ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->epfd == -1) {
+        perror("[error] epoll_create1");
+        free(ev);
+        return NULL;
+    }
+
+    ev->data_size = 256;
+    ev->data = malloc(ev->data_size * sizeof(void *));
+    memset(ev->data, 0, ev->data_size * sizeof(void *));
+
+    return ev;
+}
+
+static void backend_free(ev_loop_t *ev)
+{
+    close(ev->epfd);
+    free(ev->data);
+    free(ev);
+}
+
+/**
+ * epoll hands back the descriptor, the connection is looked up from it so
+ * events can be matched to a socket that's removed mid batch
+ */
+static bool backend_add(ev_loop_t *ev, int fd, uint32_t events, void *data)
+{
+    struct epoll_event e;
+    uint32_t size;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fd >= ev->data_size) {
+        size = ev->data_size;
+        while (fd >= size) {
+            size *= 2;
+        }
+
+        ev->data = realloc(ev->data, size * sizeof(void *));
+        memset(ev->data + ev->data_size, 0, (size - ev->data_size) * sizeof(void *));
+        ev->data_size = size;
+    }
+
+    e.events = ev_to_epoll(events);
+    e.data.fd = fd;
+
+    if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) == -1) {
+        perror("[error] epoll_ctl add");
+        return false;
+    }
+
+    ev->data[fd] = data;
+    return true;
+}
+
+static bool backend_modify(ev_loop_t *ev, int fd, uint32_t events, void *data)
+{
+    struct epoll_event e;
+
+    if (fd < 0 || fd >= ev->data_size) {
+        return false;
+    }
+
+    e.events = ev_to_epoll(events);
+    e.data.fd = fd;
+
+    if (epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fd, &e) == -1) {
+        perror("[error] epoll_ctl mod");
+        return false;
+    }
+
+    ev->data[fd] = data;
+    return true;
+}
+
+static void backend_remove(ev_loop_t *ev, int fd)
+{
+    epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    if (fd >= 0 && fd < ev->data_size) {
+        ev->data[fd] = NULL;
+    }
+}
+
+/**
+ * Wait for sockets to become ready. Only ready sockets are returned, so
+ * the cost of a wakeup doesn't depend on how many servers are connected
+ */
+static int backend_wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout)
+{
+    int count, i;
+    uint32_t e;
+
+    if (max > EV_MAXEVENTS) {
+        max = EV_MAXEVENTS;
+    }
+
+    count = epoll_wait(ev->epfd, ev->events, max, timeout);
+    if (count == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (i=0; i<count; i++) {
+        e = ev->events[i].events;
+        memset(&out[i], 0, sizeof(ev_event_t));
+        out[i].fd = ev->events[i].data.fd;
+        out[i].data = ev->data[out[i].fd];
+
+        if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            out[i].events |= EV_READ;
+        }
+
+        if (e & EPOLLOUT) {
+            out[i].events |= EV_WRITE;
+        }
+
+        if (e & (EPOLLHUP | EPOLLERR)) {
+            out[i].events |= EV_ERROR;
+        }
+    }
+
+    return count;
+}
+
+static const char *backend_name(void)
+{
+    return "epoll";
+}
+
+#else // poll
+
+static short ev_to_poll(uint32_t events)
+{
+    short e = 0;
+
+    if (events & (EV_READ | EV_ACCEPT)) {
+        e |= POLLIN;
+    }
+
+    if (events & EV_WRITE) {
+        e |= POLLOUT;
+    }
+
+    return e;
+}
+
+/**
+ * Find the array position of the given socket
+ */
+static int ev_find(ev_loop_t *ev, int fd)
+{
+    if (fd < 0 || fd >= ev->slots_size) {
+        return -1;
+    }
+
+    return ev->slots[fd];
+}
+
+static ev_loop_t *backend_create(void)
+{
+    ev_loop_t *ev;
+
+    ev = malloc(sizeof(ev_loop_t));
+    memset(ev, 0, sizeof(ev_loop_t));
+
+    ev->size = 64;
+    ev->fds = malloc(ev->size * sizeof(struct pollfd));
+    ev->data = malloc(ev->size * sizeof(void *));
+
+    ev->slots_size = 256;
+    ev->slots = malloc(ev->slots_size * sizeof(int));
+    memset(ev->slots, -1, ev->slots_size * sizeof(int));
+
+    return ev;
+}
+
+static void backend_free(ev_loop_t *ev)
+{
+    free(ev->fds);
+    free(ev->data);
+    free(ev->slots);
+    free(ev);
+}
+
+static bool backend_add(ev_loop_t *ev, int fd, uint32_t events, void *data)
+{
+    uint32_t size;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fd >= ev->slots_size) {
+        size = ev->slots_size;
+        while (fd >= size) {
+            size *= 2;
+        }
+
+        ev->slots = realloc(ev->slots, size * sizeof(int));
+        memset(ev->slots + ev->slots_size, -1, (size - ev->slots_size) * sizeof(int));
+        ev->slots_size = size;
+    }
+
+    if (ev->count == ev->size) {
+        ev->size *= 2;
+        ev->fds = realloc(ev->fds, ev->size * sizeof(struct pollfd));
+        ev->data = realloc(ev->data, ev->size * sizeof(void *));
+    }
+
+    ev->fds[ev->count].fd = fd;
+    ev->fds[ev->count].events = ev_to_poll(events);
+    ev->fds[ev->count].revents = 0;
+    ev->data[ev->count] = data;
+    ev->slots[fd] = ev->count;
+    ev->count++;
+
+    return true;
+}
+
+static bool backend_modify(ev_loop_t *ev, int fd, uint32_t events, void *data)
+{
+    int i = ev_find(ev, fd);
+
+    if (i == -1) {
+        return false;
+    }
+
+    ev->fds[i].events = ev_to_poll(events);
+    ev->data[i] = data;
+
+    return true;
+}
+
+/**
+ * Remove the socket. The last entry is moved into its place to keep the
+ * array contiguous without shifting everything after it.
+ */
+static void backend_remove(ev_loop_t *ev, int fd)
+{
+    int i = ev_find(ev, fd);
+
+    if (i == -1) {
+        return;
+    }
+
+    ev->slots[fd] = -1;
+    ev->count--;
+
+    if (i != ev->count) {
+        ev->fds[i] = ev->fds[ev->count];
+        ev->data[i] = ev->data[ev->count];
+        ev->slots[ev->fds[i].fd] = i;
+    }
+}
+
+static int backend_wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout)
+{
+    int ready, count = 0;
+    uint32_t i;
+    short e;
+
+    ready = poll(ev->fds, ev->count, timeout);
+    if (ready == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (i=0; i<ev->count && count<ready && count<max; i++) {
+        e = ev->fds[i].revents;
+        if (!e) {
+            continue;
+        }
+
+        memset(&out[count], 0, sizeof(ev_event_t));
+        out[count].fd = ev->fds[i].fd;
+        out[count].data = ev->data[i];
+
+        if (e & (POLLIN | POLLHUP | POLLERR)) {
+            out[count].events |= EV_READ;
+        }
+
+        if (e & POLLOUT) {
+            out[count].events |= EV_WRITE;
+        }
+
+        if (e & (POLLHUP | POLLERR | POLLNVAL)) {
+            out[count].events |= EV_ERROR;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+static const char *backend_name(void)
+{
+    return "poll";
+}
+
+#endif
+
+
+/**
+ * Run everything other threads posted to this loop
+ */
+static void ev_run_jobs(ev_loop_t *ev)
+{
+    char junk[64];
+    ev_job_t *job, *next;
+
+    // drain the wakeups before taking the jobs, so a post that races us
+    // always leaves a wakeup behind for its job
+    while (recv(ev->wakeup[0], junk, sizeof(junk), MSG_DONTWAIT) > 0);
+
+    pthread_mutex_lock(&ev->joblock);
+    job = ev->jobs;
+    ev->jobs = ev->lastjob = NULL;
+    pthread_mutex_unlock(&ev->joblock);
+
+    for (; job; job = next) {
+        next = job->next;
+        job->func(job->arg);
+        free(job);
+    }
+}
+
+ev_loop_t *EV_CreateLoop(void)
+{
+    ev_loop_t *ev = backend_create();
+
+    if (!ev) {
+        return NULL;
+    }
+
+#if USE_IO_URING
+    ev->uring = URING_Create();
+#endif
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ev->wakeup) == -1) {
+        perror("[error] socketpair");
+#if USE_IO_URING
+        if (ev->uring) {
+            URING_Free(ev->uring);
+        }
+#endif
+        backend_free(ev);
+        return NULL;
+    }
+
+    fcntl(ev->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(ev->wakeup[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&ev->joblock, NULL);
+
+    // the loop itself is the data for the wakeup socket
+    EV_Add(ev, ev->wakeup[0], EV_READ | EV_EDGE, ev);
+
+    return ev;
+}
+
+/**
+ * Have func(arg) called on the thread running this loop. This is the only
+ * safe way for other threads to touch connections the loop owns.
+ */
+void EV_Post(ev_loop_t *ev, void (*func)(void *arg), void *arg)
+{
+    ev_job_t *job;
+    bool wake;
+
+    job = malloc(sizeof(ev_job_t));
+    job->func = func;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&ev->joblock);
+    wake = (ev->jobs == NULL);
+    if (ev->lastjob) {
+        ev->lastjob->next = job;
+    } else {
+        ev->jobs = job;
+    }
+    ev->lastjob = job;
+    pthread_mutex_unlock(&ev->joblock);
+
+    if (wake) {
+        send(ev->wakeup[1], "", 1, MSG_DONTWAIT);
+    }
+}
+
+bool EV_Add(ev_loop_t *ev, int fd, uint32_t events, void *data)
+{
+#if USE_IO_URING
+    if (ev->uring) {
+        return URING_Add(ev->uring, fd, events, data);
+    }
+#endif
+
+    return backend_add(ev, fd, events, data);
+}
+
+bool EV_Modify(ev_loop_t *ev, int fd, uint32_t events, void *data)
+{
+#if USE_IO_URING
+    if (ev->uring) {
+        URING_Modify(ev->uring, fd, events, data);
+        return true;
+    }
+#endif
+
+    return backend_modify(ev, fd, events, data);
+}
+
+void EV_Remove(ev_loop_t *ev, int fd)
+{
+    int i;
+
+    // the socket's events not handled yet in this batch would point at a
+    // connection that's about to go, io_uring can even report several
+    for (i=0; i<ev->batch_count; i++) {
+        if (ev->batch[i].fd == fd && !(ev->batch[i].events & EV_ACCEPT)) {
+            ev->batch[i].events = 0;
+        }
+    }
+
+#if USE_IO_URING
+    if (ev->uring) {
+        URING_Remove(ev->uring, fd);
+        return;
+    }
+#endif
+
+    backend_remove(ev, fd);
+}
+
+/**
+ * Wait for something to happen. Readiness backends report EV_READ for
+ * sockets with data waiting (and for the listener, registered with no
+ * connection). io_uring reports EV_ACCEPT with the new socket and EV_DATA
+ * with the bytes already received, valid until the next call. Jobs posted
+ * from other threads are run before returning.
+ */
+int EV_Wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout)
+{
+    int count, i, j;
+    bool jobs = false;
+
+#if USE_IO_URING
+    if (ev->uring) {
+        count = URING_Wait(ev->uring, out, max, timeout);
+    } else {
+        count = backend_wait(ev, out, max, timeout);
+    }
+#else
+    count = backend_wait(ev, out, max, timeout);
+#endif
+
+    // posted jobs are handled here, the caller only sees socket events
+    for (i=0, j=0; i<count; i++) {
+        if (out[i].data == ev) {
+            jobs = true;
+            continue;
+        }
+        out[j++] = out[i];
+    }
+
+    ev->batch = out;
+    ev->batch_count = j;
+
+    // after the batch is final, a job closing a connection has to be able
+    // to scrub its events
+    if (jobs) {
+        ev_run_jobs(ev);
+    }
+
+    return (count == -1) ? -1 : j;
+}
+
+/**
+ * Interrupt the loop's wait without giving it anything to do. Safe to call
+ * from a signal handler.
+ */
+void EV_Wake(ev_loop_t *ev)
+{
+    send(ev->wakeup[1], "", 1, MSG_DONTWAIT);
+}
+
+/**
+ * Send count pieces of data on a socket as one write without blocking,
+ * same results as sendmsg(). With io_uring it's queued and goes out with
+ * the rest of this loop turn's submissions.
+ */
+ssize_t EV_Sendv(ev_loop_t *ev, int fd, const struct iovec *iov, int count)
+{
+    struct msghdr m;
+
+#if USE_IO_URING
+    if (ev->uring) {
+        return URING_Send(ev->uring, fd, iov, count);
+    }
+#endif
+
+    memset(&m, 0, sizeof(m));
+    m.msg_iov = (struct iovec *) iov;
+    m.msg_iovlen = count;
+
+    return sendmsg(fd, &m, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+ * True while data EV_Sendv() took is still on its way to the socket.
+ * Only io_uring holds on to it, the other backends hand it straight to
+ * the kernel. A connection closed before then loses it.
+ */
+bool EV_Sending(ev_loop_t *ev, int fd)
+{
+#if USE_IO_URING
+    if (ev->uring) {
+        return URING_Sending(ev->uring, fd);
+    }
+#endif
+
+    return false;
+}
+
+/**
+ * Send data on a socket without blocking, same results as send()
+ */
+ssize_t EV_Send(ev_loop_t *ev, int fd, const byte *data, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = len;
+
+    return EV_Sendv(ev, fd, &iov, 1);
+}
+
+const char *EV_BackendName(ev_loop_t *ev)
+{
+#if USE_IO_URING
+    if (ev->uring) {
+        return "io_uring";
+    }
+#endif
+
+    return backend_name();
+}
@@ -0,0 +1,307 @@
+#include "server.h"
+
+/**
+ * The RSA half of the handshake. Signing the server's challenge, wrapping
+ * the session key and checking the answer to our challenge each cost
+ * somewhere between a fraction of a millisecond and a few milliseconds,
+ * enough that a few hundred servers reconnecting at once would stall
+ * everyone else on the reactor. So each step is a job on the threadpool:
+ *
+ *   HS_HELLO       waiting for HELLO
+ *   HS_SIGNING     HELLO received, signing its challenge (job)
+ *   HS_CHALLENGED  HELLOACK sent, waiting for AUTH
+ *   HS_VERIFYING   AUTH received, checking it (job)
+ *   HS_TRUSTED     done
+ *
+ * A job gets copies of everything it needs, and its result is posted
+ * back to the reactor owning the connection. Frames that show up while a
+ * job is running wait in the connection's buffer. If the connection is
+ * closed in the meantime the result is thrown away.
+ */
+
+typedef struct hs_job_s {
+    q2_server_t *server;
+    reactor_t   *reactor;       // owns the connection, gets the result
+    RSA         *publickey;     // our own reference
+    bool        encrypted;
+    bool        ok;
+    uint64_t    elapsed;        // us spent signing
+    byte        challenge[CHALLENGE_LEN];   // theirs to sign, or ours to check against
+    byte        aeskey[AESKEY_LEN];
+    byte        iv[AESBLOCK_LEN];
+    byte        aeskey_cipher[RSA_LEN];
+    byte        cipher[RSA_LEN];    // our signature, or their answer
+    size_t      cipher_len;
+} hs_job_t;
+
+
+static hs_job_t *new_job(q2_server_t *q2)
+{
+    hs_job_t *job = malloc(sizeof(hs_job_t));
+
+    memset(job, 0, sizeof(hs_job_t));
+    job->server = q2;
+    job->reactor = q2->connection.reactor;
+    job->publickey = q2->publickey;
+    RSA_up_ref(job->publickey);
+
+    q2->connection.job = job;
+
+    return job;
+}
+
+
+static void free_job(hs_job_t *job)
+{
+    RSA_free(job->publickey);
+    free(job);
+}
+
+
+/**
+ * Is the job's connection still the one that started it? Runs on the
+ * reactor the job was posted back to.
+ */
+static bool job_current(hs_job_t *job)
+{
+    q2_server_t *q2 = job->server;
+    bool current;
+
+    pthread_mutex_lock(&q2srvlock);
+    current = q2->connected && q2->connection.reactor == job->reactor && q2->connection.job == job;
+    pthread_mutex_unlock(&q2srvlock);
+
+    if (current) {
+        q2->connection.job = NULL;
+    }
+
+    return current;
+}
+
+
+/**
+ * Signing's done, answer the HELLO. Runs on the connection's reactor.
+ */
+static void SignDone(void *arg)
+{
+    hs_job_t *job = arg;
+    q2_server_t *q2 = job->server;
+    reactor_t *r = job->reactor;
+
+    if (!job_current(job)) {
+        free_job(job);
+        return;
+    }
+
+    r->signs++;
+    r->sign_total += job->elapsed;
+    if (job->elapsed > r->sign_peak) {
+        r->sign_peak = job->elapsed;
+    }
+
+    if (!job->ok) {
+        free_job(job);
+        SendError(q2, ERR_ENCRYPTION, -1, "Problems encrypting sv_challenge");
+        CloseConnection(q2);
+        return;
+    }
+
+    // client won't send any more data until it receives this ACK
+    MSG_WriteByte(SCMD_HELLOACK, &q2->msg);
+    MSG_WriteShort(job->cipher_len, &q2->msg);
+    MSG_WriteData(job->cipher, job->cipher_len, &q2->msg);
+
+    if (job->encrypted) {
+        memcpy(q2->connection.aeskey_cipher, job->aeskey_cipher, RSA_LEN);
+        MSG_WriteData(q2->connection.aeskey_cipher, RSA_LEN, &q2->msg);
+    }
+
+    MSG_WriteData(q2->connection.cl_challenge, CHALLENGE_LEN, &q2->msg);
+    SendBuffer(q2);
+    free_job(job);
+
+    q2->connection.state = HS_CHALLENGED;
+    ResumeConnection(&q2->connection);
+}
+
+
+/**
+ * Sign the server's challenge and wrap the session key, on the threadpool
+ */
+static void SignJob(void *arg)
+{
+    hs_job_t *job = arg;
+    uint64_t started = Microseconds();
+
+    job->cipher_len = Sign_Client_Challenge(job->cipher, job->challenge);
+    job->elapsed = Microseconds() - started;
+    job->ok = job->cipher_len > 0;
+
+    if (job->ok && job->encrypted) {
+        job->ok = Encrypt_AESKey(job->publickey, job->aeskey, job->iv, job->aeskey_cipher) == RSA_LEN;
+    }
+
+    EV_Post(job->reactor->loop, SignDone, job);
+}
+
+
+/**
+ * A client sent us a challenge. Start encrypting it to send back along
+ * with our challenge to them (and any encryption keys required).
+ */
+bool ServerAuthResponse(q2_server_t *q2, byte *challenge)
+{
+    connection_t *c = &q2->connection;
+    hs_job_t *job;
+
+    // random data for our challenge, kept for checking their answer
+    RAND_bytes(c->cl_challenge, CHALLENGE_LEN);
+
+    // client wants the connection encrypted
+    if (c->encrypted) {
+        RAND_bytes(c->aeskey, AESKEY_LEN);  // session key
+        RAND_bytes(c->iv, AESBLOCK_LEN);    // initialization vector
+    }
+
+    job = new_job(q2);
+    memcpy(job->challenge, challenge, CHALLENGE_LEN);
+    job->encrypted = c->encrypted;
+    memcpy(job->aeskey, c->aeskey, AESKEY_LEN);
+    memcpy(job->iv, c->iv, AESBLOCK_LEN);
+
+    c->state = HS_SIGNING;
+    if (thpool_add_work(pool, SignJob, job)) {
+        c->job = NULL;
+        free_job(job);
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * The client's answer has been checked. Runs on the connection's reactor.
+ */
+static void VerifyDone(void *arg)
+{
+    hs_job_t *job = arg;
+    q2_server_t *q2 = job->server;
+    bool ok = job->ok;
+
+    if (!job_current(job)) {
+        free_job(job);
+        return;
+    }
+
+    free_job(job);
+
+    if (!ok) {
+        printf("[error] %s connected but is NOT trusted, disconnecting\n", q2->name);
+        AuthFailed(q2);
+        return;
+    }
+
+    if (q2->connection.encrypted && !SymmetricInit(q2)) {
+        SendError(q2, ERR_ENCRYPTION, -1, "Problems setting up session encryption");
+        CloseConnection(q2);
+        return;
+    }
+
+    q2->connection.state = HS_TRUSTED;
+    q2->trusted = true;
+    PublishServer(q2);
+
+    EndPending(&q2->connection);
+
+    printf("%s is trusted\n", q2->name);
+    MSG_WriteByte(SCMD_TRUSTED, &q2->msg);
+    SendBuffer(q2);
+
+    ResumeConnection(&q2->connection);
+}
+
+
+/**
+ * Decrypt the nonce the client returned to us, on the threadpool
+ */
+static void VerifyJob(void *arg)
+{
+    hs_job_t *job = arg;
+    byte plaintext[RSA_LEN];
+    int count;
+
+    count = RSA_public_decrypt(
+            job->cipher_len,
+            job->cipher,
+            plaintext,
+            job->publickey,
+            RSA_PKCS1_PADDING
+    );
+
+    job->ok = count == CHALLENGE_LEN && memcmp(job->challenge, plaintext, CHALLENGE_LEN) == 0;
+
+    EV_Post(job->reactor->loop, VerifyDone, job);
+}
+
+
+/**
+ * Start checking the nonce the client returned to us. False if the
+ * message is no good.
+ */
+bool VerifyClientChallenge(q2_server_t *q2, msg_buffer_t *msg)
+{
+    connection_t *c = &q2->connection;
+    hs_job_t *job;
+    byte cipher[RSA_LEN];
+    size_t len;
+
+    len = MSG_ReadShort(msg);
+    if (len > sizeof(cipher)) {
+        return false;
+    }
+    MSG_ReadData(msg, cipher, len);
+
+    if (msg->overflowed) {
+        return false;
+    }
+
+    // nothing more to prove
+    if (c->state == HS_TRUSTED) {
+        return true;
+    }
+
+    // only after we've sent our challenge
+    if (c->state != HS_CHALLENGED) {
+        return false;
+    }
+
+    job = new_job(q2);
+    job->cipher_len = len;
+    memcpy(job->cipher, cipher, len);
+    memcpy(job->challenge, c->cl_challenge, CHALLENGE_LEN);
+
+    c->state = HS_VERIFYING;
+    if (thpool_add_work(pool, VerifyJob, job)) {
+        c->job = NULL;
+        free_job(job);
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Tell the client we don't believe them and hang up
+ */
+void AuthFailed(q2_server_t *q2)
+{
+    MSG_WriteByte(SCMD_ERROR, &q2->msg);
+    MSG_WriteByte(-1, &q2->msg);
+    MSG_WriteByte(ERR_UNAUTHORIZED, &q2->msg);
+    MSG_WriteString("Client authentication failed", &q2->msg);
+    SendBuffer(q2);
+
+    CloseConnection(q2);
+}
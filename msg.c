@@ -3,90 +3,303 @@
 
 char buffer[0xffff];
 
-void MSG_ReadData(msg_buffer_t *msg, void *out, size_t len)
+/**
+ * Every read checks there's enough message left first. Reading past the
+ * end sets msg->overflowed and everything after that reads as zeros and
+ * empty strings, so parsers can read a whole command and check once at
+ * the end instead of after every field.
+ */
+
+/**
+ * Take the next len bytes, or NULL if the message is short
+ */
+const byte *MSG_ReadSpan(msg_buffer_t *msg, size_t len)
 {
-	memcpy(out, &(msg->data[msg->index]), len);
+	const byte *p;
+
+	if (msg->overflowed || msg->index > msg->length || len > msg->length - msg->index) {
+		msg->overflowed = true;
+		msg->index = msg->length;
+		return NULL;
+	}
+
+	p = msg->data + msg->index;
 	msg->index += len;
+	return p;
+}
+
+void MSG_ReadData(msg_buffer_t *msg, void *out, size_t len)
+{
+	const byte *p = MSG_ReadSpan(msg, len);
+
+	if (p) {
+		memcpy(out, p, len);
+	} else {
+		memset(out, 0, len);
+	}
 }
 
 // unsigned
 uint8_t MSG_ReadByte(msg_buffer_t *msg)
 {
-	unsigned char b = msg->data[msg->index];
-	msg->index++;
-	return b & 0xff;
+	const byte *p = MSG_ReadSpan(msg, 1);
+	return (p) ? *p : 0;
 }
 
 // signed
 int8_t MSG_ReadChar(msg_buffer_t *msg)
 {
-    signed char c = msg->data[msg->index];
-    msg->index++;
-    return c;
+	const byte *p = MSG_ReadSpan(msg, 1);
+	return (p) ? (int8_t) *p : 0;
 }
 
 uint16_t MSG_ReadShort(msg_buffer_t *msg)
 {
-	return 	(msg->data[msg->index++] +
-			(msg->data[msg->index++] << 8)) & 0xffff;
+	const byte *p = MSG_ReadSpan(msg, 2);
+	return (p) ? LittleShort(p) : 0;
 }
 
 int16_t MSG_ReadWord(msg_buffer_t *msg)
 {
-	return 	(msg->data[msg->index++] +
-			(msg->data[msg->index++] << 8));
+	const byte *p = MSG_ReadSpan(msg, 2);
+	return (p) ? (int16_t) LittleShort(p) : 0;
 }
 
 int32_t MSG_ReadLong(msg_buffer_t *msg)
 {
-	return 	msg->data[msg->index++] +
-			(msg->data[msg->index++] << 8) +
-			(msg->data[msg->index++] << 16) +
-			(msg->data[msg->index++] << 24);
+	const byte *p = MSG_ReadSpan(msg, 4);
+	return (p) ? (int32_t) LittleLong(p) : 0;
 }
 
-char *MSG_ReadString(msg_buffer_t *msg)
+/**
+ * Point at the next string in the message without copying it. It's the
+ * raw bytes, high bits and all.
+ */
+msg_string_t MSG_ReadStringView(msg_buffer_t *msg)
 {
-	static char str[MAX_STRING_CHARS];
-	static char character;
-	size_t i, len = 0;
+	msg_string_t s = {"", 0};
+	byte *end;
 
-	do {
-		len++;
-	} while (msg->data[(msg->index + len)] != 0);
+	// the buffer isn't zeroed past the message, stop at its end
+	if (!msg->overflowed && msg->index < msg->length) {
+		s.data = (char *) msg->data + msg->index;
+		end = memchr(s.data, 0, msg->length - msg->index);
+		s.len = (end) ? end - (byte *) s.data : msg->length - msg->index;
+		msg->index += (end) ? s.len + 1 : s.len;
+	}
 
-	memset(&str, 0, MAX_STRING_CHARS);
+	return s;
+}
 
-	for (i=0; i<=len; i++) {
-		character = MSG_ReadByte(msg) & 0x7f;
-		strcat(str,  &character);
+
+/**
+ * Copy a string view out as much as fits in size, always terminated.
+ * Strip clears the high bits q2 uses for colored text.
+ */
+size_t MSG_CopyString(msg_string_t s, char *out, size_t size, bool strip)
+{
+	size_t len = (s.len < size - 1) ? s.len : size - 1;
+	size_t i;
+
+	if (strip) {
+		for (i=0; i<len; i++) {
+			out[i] = s.data[i] & 0x7f;
+		}
+	} else {
+		memcpy(out, s.data, len);
 	}
+	out[len] = 0;
+
+	return len;
+}
+
+
+/**
+ * The string is copied to the thread's arena, it's good until the
+ * message is done being parsed
+ */
+char *MSG_ReadString(msg_buffer_t *msg)
+{
+	msg_string_t s = MSG_ReadStringView(msg);
+	size_t size = (s.len < MAX_STRING_CHARS) ? s.len + 1 : MAX_STRING_CHARS;
+	char *str = ARENA_Alloc(size);
+
+	MSG_CopyString(s, str, size, true);
 
 	return str;
 }
 
 
+/**
+ * Message buffers don't own any storage until something is written to
+ * them, then they borrow a block from a pool sized to fit and give it
+ * back when they're empty again. Each thread keeps its own free blocks,
+ * so there's no locking. A block freed on another thread just joins that
+ * thread's pool.
+ */
+static const size_t msg_classes[MSG_CLASSES] = {
+    512, 4 * 1024, 16 * 1024, MSG_MAXSIZE
+};
+
+typedef struct msg_block_s {
+    struct msg_block_s *next;
+} msg_block_t;
+
+static __thread msg_block_t *msg_free[MSG_CLASSES];
+static __thread uint32_t msg_free_count[MSG_CLASSES];
+
+
+/**
+ * Make room for the buffer to hold at least size bytes, moving what's
+ * already there if it needs a bigger block. Returns false if nothing
+ * that big is available.
+ */
+bool MSG_Reserve(msg_buffer_t *buf, size_t size)
+{
+    msg_block_t *block;
+    byte *data;
+    size_t length;
+    uint32_t index, i;
+
+    if (size <= buf->size) {
+        return true;
+    }
+
+    for (i=0; i<MSG_CLASSES; i++) {
+        if (size <= msg_classes[i]) {
+            break;
+        }
+    }
+
+    if (i == MSG_CLASSES) {
+        return false;
+    }
+
+    if ((block = msg_free[i])) {
+        msg_free[i] = block->next;
+        msg_free_count[i]--;
+        data = (byte *) block;
+    } else {
+        data = malloc(msg_classes[i]);
+    }
+
+    length = buf->length;
+    index = buf->index;
+
+    if (buf->data) {
+        memcpy(data, buf->data, (index > length) ? index : length);
+        MSG_Release(buf);
+    }
+
+    buf->length = length;
+    buf->index = index;
+    buf->data = data;
+    buf->size = msg_classes[i];
+    return true;
+}
+
+
+/**
+ * Empty the buffer and give its storage back to the pool
+ */
+void MSG_Release(msg_buffer_t *buf)
+{
+    msg_block_t *block = (msg_block_t *) buf->data;
+    uint32_t i;
+
+    buf->length = 0;
+    buf->index = 0;
+    buf->overflowed = false;
+
+    if (!block) {
+        return;
+    }
+
+    buf->data = NULL;
+
+    for (i=0; i<MSG_CLASSES; i++) {
+        if (buf->size == msg_classes[i]) {
+            break;
+        }
+    }
+
+    buf->size = 0;
+
+    if (i == MSG_CLASSES || msg_free_count[i] >= MSG_POOL_KEEP) {
+        free(block);
+        return;
+    }
+
+    block->next = msg_free[i];
+    msg_free[i] = block;
+    msg_free_count[i]++;
+}
+
+
+/**
+ * Writes that don't fit anywhere are dropped
+ */
+static inline bool msg_room(msg_buffer_t *buf, size_t len)
+{
+    return buf->index + len <= buf->size || MSG_Reserve(buf, buf->index + len);
+}
+
+
+/**
+ * Make room for len more bytes at the end of the buffer and return where
+ * they go, for callers to fill in themselves. NULL if it won't fit, then
+ * nothing is written and buf->overflowed is set. Once it's set every
+ * later write fails too, so a command is never sent with a piece missing
+ * from the middle. SendBuffer() throws away a buffer that overflowed.
+ */
+byte *MSG_WriteSpan(msg_buffer_t *buf, size_t len)
+{
+	byte *p;
+
+	if (buf->overflowed) {
+		return NULL;
+	}
+
+	if (!msg_room(buf, len)) {
+		buf->overflowed = true;
+		return NULL;
+	}
+
+	p = buf->data + buf->index;
+	buf->index += len;
+	buf->length += len;
+	return p;
+}
+
 void MSG_WriteByte(byte b, msg_buffer_t *buf)
 {
-	buf->data[buf->index] = b;
-	buf->index++;
-	buf->length++;
+	byte *p = MSG_WriteSpan(buf, 1);
+
+	if (p) {
+		*p = b;
+	}
 }
 
 void MSG_WriteShort(uint16_t s, msg_buffer_t *buf)
 {
-	buf->data[buf->index++] = s & 0xff;
-	buf->data[buf->index++] = s >> 8;
-	buf->length += 2;
+	byte *p = MSG_WriteSpan(buf, 2);
+
+	if (p) {
+		p[0] = s & 0xff;
+		p[1] = s >> 8;
+	}
 }
 
 void MSG_WriteLong(uint32_t l, msg_buffer_t *buf)
 {
-	buf->data[buf->index++] = l & 0xff;
-	buf->data[buf->index++] = (l >> 8) & 0xff;
-	buf->data[buf->index++] = (l >> 16) & 0xff;
-	buf->data[buf->index++] = l >> 24;
-	buf->length += 4;
+	byte *p = MSG_WriteSpan(buf, 4);
+
+	if (p) {
+		p[0] = l & 0xff;
+		p[1] = (l >> 8) & 0xff;
+		p[2] = (l >> 16) & 0xff;
+		p[3] = l >> 24;
+	}
 }
 
 void MSG_WriteString(const char *str, msg_buffer_t *buf)
@@ -105,9 +318,10 @@ void MSG_WriteString(const char *str, msg_buffer_t *buf)
 
 void MSG_WriteData(const void *data, size_t length, msg_buffer_t *buf)
 {
-	uint32_t i;
-	for (i=0; i<length; i++) {
-		MSG_WriteByte(((byte *) data)[i], buf);
+	byte *p = MSG_WriteSpan(buf, length);
+
+	if (p) {
+		memcpy(p, data, length);
 	}
 }
 
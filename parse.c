@@ -7,29 +7,31 @@
 void ParseMessage(q2_server_t *q2, msg_buffer_t *msg)
 {
     uint8_t cmd;
-    msg_buffer_t e;
+    byte *payload;
+    ssize_t len;
+    arena_mark_t scratch = ARENA_Mark();
 
-    // decrypt if necessary
+    // decrypt if necessary, msg is one frame of the connection's buffer and
+    // the plaintext is never longer, so it's done where it sits
     if (q2->connection.encrypted && q2->trusted) {
-        memset(&e, 0, sizeof(msg_buffer_t));
-        e.length = SymmetricDecrypt(q2, e.data, msg->data, msg->length);
-        memset(msg, 0, sizeof(msg_buffer_t));
-        memcpy(msg->data, e.data, e.length);
-        msg->length = e.length;
+        payload = msg->data + msg->index;
+        len = SymmetricDecrypt(q2, payload, payload, msg->length - msg->index);
+        if (len < 0) {
+            printf("[warn] %s sent a message that doesn't decrypt, disconnecting\n", q2->name);
+            CloseConnection(q2);
+            return;
+        }
+
+        msg->length = msg->index + len;
     }
 
     if (config.debug) {
-        hexDump("New Message", msg->data, msg->length);
+        hexDump("New Message", msg->data + msg->index, msg->length - msg->index);
     }
 
-    // keep parsing msgs while data is in the buffer
-    while (msg->index < msg->length) {
-
-        // this should never happen, but teleport command is causing it
-        if (msg->index > sizeof(msg->data)) {
-            break;
-        }
-
+    // keep parsing msgs while data is in the buffer, unless one of them
+    // got the server disconnected
+    while (q2->connected && msg->index < msg->length) {
         cmd = MSG_ReadByte(msg);
 
         switch(cmd) {
@@ -64,21 +66,42 @@ void ParseMessage(q2_server_t *q2, msg_buffer_t *msg)
             ParseMap(q2, msg);
             break;
         }
+
+        // a command ran past the end, nothing after it can be trusted
+        if (msg->overflowed) {
+            printf("[warn] truncated message from %s\n", q2->name);
+            break;
+        }
     }
+
+    // map and players might have changed
+    PublishServer(q2);
+
+    // strings read and built along the way are done with
+    ARENA_Reset(scratch);
 }
 
 
 /**
- * Parse the first message sent from the client
+ * Parse the first message sent from the client. It's all fixed size,
+ * so the length is checked once up front. False if it's too short.
  */
-void ParseHello(hello_t *h, msg_buffer_t *in)
+bool ParseHello(hello_t *h, msg_buffer_t *in)
 {
-    h->key = MSG_ReadLong(in);
-    h->version = MSG_ReadLong(in);
-    h->port = MSG_ReadShort(in);
-    h->max_clients = MSG_ReadByte(in);
-    h->encrypted = MSG_ReadByte(in);
-    MSG_ReadData(in, h->challenge, CHALLENGE_LEN);
+    const byte *p = MSG_ReadSpan(in, HELLO_LEN);
+
+    if (!p) {
+        return false;
+    }
+
+    h->key = LittleLong(p);
+    h->version = LittleLong(p + 4);
+    h->port = LittleShort(p + 8);
+    h->max_clients = p[10];
+    h->encrypted = p[11];
+    memcpy(h->challenge, p + 12, CHALLENGE_LEN);
+
+    return true;
 }
 
 
@@ -90,10 +113,10 @@ void ParseHello(hello_t *h, msg_buffer_t *in)
 void ParsePrint(q2_server_t *srv, msg_buffer_t *in)
 {
     uint8_t level;
-    char *string;
+    msg_string_t string;
 
     level = MSG_ReadByte(in);
-    string = MSG_ReadString(in);
+    string = MSG_ReadStringView(in);
 
     // obituary, parse for means of death
     if (level == PRINT_MEDIUM) {
@@ -134,27 +157,28 @@ void ParseCommand(q2_server_t *srv, msg_buffer_t *in)
 void ParseTeleport(q2_server_t *srv, msg_buffer_t *in)
 {
     uint8_t client_id;
-    char *location;
+    msg_string_t location;
     char *reply;
-    q2_server_t *server, *found = 0;
+    server_info_t *found;
     char *srvstr;
 
     client_id = MSG_ReadByte(in);
-    location = MSG_ReadString(in);
+    location = MSG_ReadStringView(in);
+
+    if (in->overflowed) {
+        return;
+    }
 
     // player just issued teleport command with no arg, show available servers
-    if (!*location) {
+    if (!location.len) {
         srvstr = BuildTeleportServers();
         ClientText(srv, client_id, PRINT_HIGH, srvstr);
         SendBuffer(srv);
         return;
     }
 
-    FOR_EACH_SERVER(server) {
-        if (strcmp(server->name, location) == 0) {
-            found = server;
-        }
-    }
+    // only the registry, the server belongs to another reactor
+    found = find_server_by_name(location.data, location.len);
 
     // do stuff
     if (found) {
@@ -166,7 +190,9 @@ void ParseTeleport(q2_server_t *srv, msg_buffer_t *in)
         MSG_WriteByte(SCMD_COMMAND, &srv->msg);
         MSG_WriteString(stuff, &srv->msg);
     } else {
-        reply = va("\"%s\" could not be located\n", location);
+        srvstr = ARENA_Alloc(location.len + 1);
+        MSG_CopyString(location, srvstr, location.len + 1, true);
+        reply = va("\"%s\" could not be located\n", srvstr);
         ClientText(srv, client_id, PRINT_HIGH, reply);
     }
 
@@ -179,20 +205,27 @@ void ParseTeleport(q2_server_t *srv, msg_buffer_t *in)
  */
 void ParseInvite(q2_server_t *srv, msg_buffer_t *in)
 {
-    q2_server_t *s;
-    uint8_t client_id;
+    q2_player_t *p;
+    const char *name;
     char *text;
     char message[MAX_STRING_CHARS];
 
-    client_id = MSG_ReadByte(in);
+    p = PL_Get(srv, MSG_ReadByte(in));
     text = MSG_ReadString(in);
 
+    if (in->overflowed) {
+        return;
+    }
+
+    // we might not have heard about them yet
+    name = (p) ? p->name : "someone";
+
     // handle flood detection here
 
     if (text[0]) {
         strncpy(message,
             va("%s invites you to play on %s: %s",
-                    srv->players[client_id].name,
+                    name,
                     srv->name,
                     text
             ),
@@ -201,22 +234,14 @@ void ParseInvite(q2_server_t *srv, msg_buffer_t *in)
     } else {
         strncpy(message,
             va("You are cordially invited to join %s playing on %s",
-                    srv->players[client_id].name,
+                    name,
                     srv->name
             ),
             sizeof(message)
         );
     }
 
-    FOR_EACH_SERVER(s) {
-        if (!s->connected) {
-            continue;
-        }
-
-        MSG_WriteByte(SCMD_SAYALL, &s->msg);
-        MSG_WriteString(message, &s->msg);
-        SendBuffer(s);
-    }
+    BroadcastSay(srv->connection.reactor, message);
 }
 
 
@@ -236,39 +261,35 @@ void ParsePlayerConnect(q2_server_t *srv, msg_buffer_t *in)
 {
     uint8_t client_id;
     char *userinfo;
-    char *name;
     q2_player_t *p;
 
     client_id = MSG_ReadByte(in);
     userinfo = MSG_ReadString(in);
-    name = Info_ValueForKey(userinfo, "name");
 
-    printf("%s just connected\n", name);
+    if (in->overflowed) {
+        return;
+    }
 
-    memset(&srv->players[client_id], 0, sizeof(q2_player_t));
-    p = &srv->players[client_id];
-    p->client_id = client_id;
-    strncpy(p->name, name, sizeof(p->name));
-    strncpy(p->userinfo, userinfo, sizeof(p->userinfo));
+    p = PL_Add(srv, client_id, userinfo);
 
-    srv->playercount++;
+    printf("%s just connected\n", p->name);
 
     //thpool_add_work(pool, TestThreading, "thread1");
 }
 
 
 /**
- *
+ * Another q2admin server wants something. False if the connection broke
+ * answering it.
  */
-void ParsePeerRequest(msg_buffer_t *in, uint32_t index)
+bool ParsePeerRequest(msg_buffer_t *in, connection_t *c)
 {
-    uint32_t peerreq;
-
     switch (MSG_ReadByte(in)) {
     case PEER_GETSERVERS:
-        P_GetServerList(index);
-        break;
+        return P_GetServerList(c);
     }
+
+    return true;
 }
 
 
@@ -279,20 +300,18 @@ void ParsePlayerUpdate(q2_server_t *srv, msg_buffer_t *in)
 {
     uint8_t client_id;
     char *userinfo;
-    char *name;
     q2_player_t *p;
 
     client_id = MSG_ReadByte(in);
     userinfo = MSG_ReadString(in);
-    name = Info_ValueForKey(userinfo, "name");
 
-    printf("%s updated\n", name);
+    if (in->overflowed) {
+        return;
+    }
+
+    p = PL_Add(srv, client_id, userinfo);
 
-    memset(&srv->players[client_id], 0, sizeof(q2_player_t));
-    p = &srv->players[client_id];
-    p->client_id = client_id;
-    strncpy(p->name, name, sizeof(p->name));
-    strncpy(p->userinfo, userinfo, sizeof(p->userinfo));
+    printf("%s updated\n", p->name);
 }
 
 
@@ -303,10 +322,13 @@ void ParsePlayerDisconnect(q2_server_t *srv, msg_buffer_t *in)
 {
     uint8_t client_id = MSG_ReadByte(in);
 
+    if (in->overflowed) {
+        return;
+    }
+
     printf("%d disconnected from %s\n", client_id, srv->name);
 
-    memset(&srv->players[client_id], 0, sizeof(q2_player_t));
-    srv->playercount--;
+    PL_Remove(srv, client_id);
 }
 
 
@@ -315,10 +337,7 @@ void ParsePlayerDisconnect(q2_server_t *srv, msg_buffer_t *in)
  */
 void ParseMap(q2_server_t *srv, msg_buffer_t *in)
 {
-    char *map;
-
-    map = MSG_ReadString(in);
-    strncpy(srv->map, map, sizeof(srv->map));
+    MSG_CopyString(MSG_ReadStringView(in), srv->map, sizeof(srv->map), true);
 }
 
 
@@ -327,22 +346,22 @@ void ParseMap(q2_server_t *srv, msg_buffer_t *in)
  */
 void ParsePlayerList(q2_server_t *srv, msg_buffer_t *in)
 {
-    uint8_t i, client_id;
+    uint8_t i, count, client_id;
     char *ui;
     q2_player_t *p;
 
-    srv->playercount = MSG_ReadByte(in);
+    count = MSG_ReadByte(in);
+    PL_Clear(srv);
 
-    for (i=0; i<srv->playercount; i++) {
-        p = &srv->players[i];
-        i = MSG_ReadByte(in);
+    for (i=0; i<count; i++) {
+        client_id = MSG_ReadByte(in);
         ui = MSG_ReadString(in);
 
-        memset(p, 0, sizeof(q2_player_t));
+        if (in->overflowed) {
+            break;
+        }
 
-        p->client_id = i;
-        strncpy(p->userinfo, ui, sizeof(p->userinfo));
-        strncpy(p->name, Info_ValueForKey(ui, "name"), sizeof(p->name));
+        p = PL_Add(srv, client_id, ui);
 
         printf("Found %s\n", p->name);
     }
@@ -354,17 +373,8 @@ void ParsePlayerList(q2_server_t *srv, msg_buffer_t *in)
  */
 void ParseAuth(q2_server_t *q2, msg_buffer_t *in)
 {
+    // the rest happens once it's been checked, see handshake.c
     if (!VerifyClientChallenge(q2, in)) {
-        MSG_WriteByte(SCMD_ERROR, &q2->msg);
-        MSG_WriteByte(-1, &q2->msg);
-        MSG_WriteByte(ERR_UNAUTHORIZED, &q2->msg);
-        MSG_WriteString("Client authentication failed", &q2->msg);
-        SendBuffer(q2);
-
-        CloseConnection(q2);
+        AuthFailed(q2);
     }
-
-    printf("%s is trusted\n", q2->name);
-    MSG_WriteByte(SCMD_TRUSTED, &q2->msg);
-    SendBuffer(q2);
 }
@@ -10,35 +10,56 @@ static void ip_to_bytes(const char *ip, byte *out)
 }
 
 /**
- * generate a list of all active servers to give to a peer
+ * generate a list of all active servers to give to a peer. The answer is
+ * the same as it's always been: no frame header, the number of servers,
+ * then the servers. The caller closes the connection once it's gone out.
+ *
+ * The servers are picked first so the count matches what's sent, the
+ * registry can change underneath while the list is written. A list too
+ * big for one buffer goes out a buffer at a time.
+ *
+ * False if the connection broke sending it.
  */
-void P_GetServerList(uint32_t index)
+bool P_GetServerList(connection_t *c)
 {
     msg_buffer_t msg;
-    q2_server_t *s;
+    server_info_t *s;
+    server_info_t **list;
     byte ipdata[4];
-    uint16_t count = 0;
+    uint32_t count = 0, i;
+    size_t namelen;
 
     printf("[info] peer connected\n");
 
+    list = malloc(sizeof(server_info_t *) * (registry_count + 1));
+
     FOR_EACH_SERVER(s) {
-        if (s->connected && s->trusted) {
-            count++;
+        if (s->connected && s->trusted && count < 0xffff) {
+            list[count++] = s;
         }
     }
 
     memset(&msg, 0, sizeof(msg_buffer_t));
     MSG_WriteShort(count, &msg);
 
-    FOR_EACH_SERVER(s) {
-        if (s->connected && s->trusted) {
-            ip_to_bytes(s->ip, ipdata);
-            MSG_WriteData(ipdata, 4, &msg); // q2 is ipv4 only, so always 4 bytes
-            MSG_WriteShort(s->port, &msg);
-            MSG_WriteString(s->name, &msg);
+    for (i=0; i<count; i++) {
+        s = list[i];
+
+        // ip, port, name
+        namelen = strlen(s->name);
+        if (msg.length + 4 + 2 + namelen + 1 > MSG_MAXSIZE && !SendRaw(c, &msg)) {
+            free(list);
+            return false;
         }
+
+        ip_to_bytes(s->ip, ipdata);
+        MSG_WriteData(ipdata, 4, &msg); // q2 is ipv4 only, so always 4 bytes
+        MSG_WriteShort(s->port, &msg);
+        MSG_WriteData(s->name, namelen, &msg);
+        MSG_WriteByte(0, &msg);
     }
 
-    send(sockets[index].fd, msg.data, msg.length, 0);
-    close(sockets[index].fd);
+    free(list);
+
+    return SendRaw(c, &msg);
 }
@@ -0,0 +1,286 @@
+#include "server.h"
+
+/**
+ * Players on each server. The table is indexed by client_id and a bitmap
+ * marks the slots in use, so walking the players of every server only
+ * touches the names and counters of players that are actually there.
+ *
+ * Userinfo strings are rarely looked at, they're interned in one table
+ * shared by every server so they stay out of the way and identical ones
+ * are only stored once. When a string is first interned it's scanned for
+ * the common keys (info_key_t), so those are found without going through
+ * it again, and a player resending the same userinfo gets the same copy
+ * back and can tell nothing changed.
+ */
+
+typedef struct {
+    uint32_t    refs;
+    uint16_t    off[INFO_KEYS];     // where each common key's value starts
+    uint16_t    len[INFO_KEYS];     // 0 if it's not there
+    char        str[];
+} interned_t;
+
+static const char *info_keys[INFO_KEYS] = {
+    [INFO_NAME] = "name",
+    [INFO_IP]   = "ip",
+    [INFO_SKIN] = "skin",
+    [INFO_HAND] = "hand",
+};
+
+static GHashTable *interned;
+static pthread_mutex_t internlock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Find the common keys in a new userinfo string. The first of a key
+ * counts, like Info_ValueForKey().
+ */
+static void index_info(interned_t *in, size_t len)
+{
+    const char *s = in->str, *end = in->str + len;
+    const char *key, *value, *sep;
+    size_t keylen, valuelen;
+    uint32_t found = 0;
+    uint32_t i;
+
+    if (s < end && *s == '\\') {
+        s++;
+    }
+
+    while (s < end && found != (1 << INFO_KEYS) - 1) {
+        key = s;
+        sep = memchr(s, '\\', end - s);
+        if (!sep) {
+            break;
+        }
+        keylen = sep - key;
+
+        value = sep + 1;
+        sep = memchr(value, '\\', end - value);
+        valuelen = (sep) ? sep - value : end - value;
+        s = value + valuelen + 1;
+
+        for (i=0; i<INFO_KEYS; i++) {
+            if (found & (1 << i) || strlen(info_keys[i]) != keylen) {
+                continue;
+            }
+
+            if (!memcmp(info_keys[i], key, keylen)) {
+                in->off[i] = value - in->str;
+                in->len[i] = valuelen;
+                found |= 1 << i;
+                break;
+            }
+        }
+    }
+}
+
+
+/**
+ * Get a shared copy of a string, release it with PL_Release()
+ */
+const char *PL_Intern(const char *str)
+{
+    interned_t *in;
+    size_t len;
+
+    pthread_mutex_lock(&internlock);
+
+    if (!interned) {
+        interned = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    in = g_hash_table_lookup(interned, str);
+    if (in) {
+        in->refs++;
+    } else {
+        len = strlen(str);
+        in = malloc(sizeof(interned_t) + len + 1);
+        memset(in, 0, sizeof(interned_t));
+        in->refs = 1;
+        memcpy(in->str, str, len + 1);
+        index_info(in, len);
+        g_hash_table_insert(interned, in->str, in);
+    }
+
+    pthread_mutex_unlock(&internlock);
+
+    return in->str;
+}
+
+
+/**
+ * Done with a string from PL_Intern()
+ */
+void PL_Release(const char *str)
+{
+    interned_t *in;
+
+    if (!str) {
+        return;
+    }
+
+    in = (interned_t *) (str - q_offsetof(interned_t, str));
+
+    pthread_mutex_lock(&internlock);
+
+    if (--in->refs == 0) {
+        g_hash_table_remove(interned, in->str);
+        free(in);
+    }
+
+    pthread_mutex_unlock(&internlock);
+}
+
+
+/**
+ * A player joined or changed their userinfo. Their stats carry over if
+ * they were already there.
+ */
+q2_player_t *PL_Add(q2_server_t *srv, uint8_t id, const char *userinfo)
+{
+    player_table_t *t = srv->players;
+    q2_player_t *p = &t->slot[id];
+    uint64_t bit = 1ULL << (id & 63);
+    const char *info = PL_Intern(userinfo);
+    const char *old = NULL;
+    msg_string_t oldname = {"", 0}, name;
+    bool joined = false;
+
+    if (t->used[id >> 6] & bit) {
+        // same string, same copy, nothing changed
+        if (p->userinfo == info) {
+            PL_Release(info);
+            return p;
+        }
+        old = p->userinfo;
+        oldname = PL_Info(p, INFO_NAME);
+    } else {
+        memset(p, 0, sizeof(q2_player_t));
+        t->used[id >> 6] |= bit;
+        p->client_id = id;
+        srv->playercount++;
+        joined = true;
+    }
+
+    p->userinfo = info;
+    name = PL_Info(p, INFO_NAME);
+
+    // skin, hand, fov and the like don't show up in the published list
+    if (joined || name.len != oldname.len || memcmp(name.data, oldname.data, name.len)) {
+        MSG_CopyString(name, p->name, sizeof(p->name), false);
+        srv->players_changed = true;
+    }
+
+    // the old name was pointing into this
+    PL_Release(old);
+
+    return p;
+}
+
+
+/**
+ * One of the common userinfo values for a player, empty if it's not set
+ */
+msg_string_t PL_Info(const q2_player_t *p, info_key_t key)
+{
+    const interned_t *in;
+    msg_string_t s = {"", 0};
+
+    if (!p->userinfo) {
+        return s;
+    }
+
+    in = (const interned_t *) (p->userinfo - q_offsetof(interned_t, str));
+    s.data = in->str + in->off[key];
+    s.len = in->len[key];
+
+    return s;
+}
+
+
+/**
+ * The player in a slot, or NULL if nobody is there
+ */
+q2_player_t *PL_Get(q2_server_t *srv, uint8_t id)
+{
+    player_table_t *t = srv->players;
+
+    if (!t || !(t->used[id >> 6] & (1ULL << (id & 63)))) {
+        return NULL;
+    }
+
+    return &t->slot[id];
+}
+
+
+/**
+ * The next player after p (the first one if p is NULL), or NULL when
+ * there are no more
+ */
+q2_player_t *PL_Next(q2_server_t *srv, q2_player_t *p)
+{
+    player_table_t *t = srv->players;
+    uint32_t id, word;
+    uint64_t bits;
+
+    if (!t) {
+        return NULL;
+    }
+
+    id = (p) ? p->client_id + 1 : 0;
+
+    while (id < MAX_PLAYERS) {
+        word = id >> 6;
+        bits = t->used[word] & (~0ULL << (id & 63));
+
+        if (bits) {
+            return &t->slot[(word << 6) + __builtin_ctzll(bits)];
+        }
+
+        id = (word + 1) << 6;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * A player left
+ */
+void PL_Remove(q2_server_t *srv, uint8_t id)
+{
+    q2_player_t *p = PL_Get(srv, id);
+
+    if (!p) {
+        return;
+    }
+
+    PL_Release(p->userinfo);
+    p->userinfo = NULL;
+    srv->players->used[id >> 6] &= ~(1ULL << (id & 63));
+    srv->playercount--;
+    srv->players_changed = true;
+}
+
+
+/**
+ * Everyone's gone, the server disconnected or is sending a new list
+ */
+void PL_Clear(q2_server_t *srv)
+{
+    q2_player_t *p;
+
+    if (!srv->players) {
+        return;
+    }
+
+    FOR_EACH_PLAYER(srv, p) {
+        PL_Release(p->userinfo);
+        p->userinfo = NULL;
+    }
+
+    memset(srv->players->used, 0, sizeof(srv->players->used));
+    srv->playercount = 0;
+    srv->players_changed = true;
+}
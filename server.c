@@ -1,13 +1,24 @@
+#define _GNU_SOURCE         // SO_REUSEPORT, accept4
 
 #include "server.h"
 
-LIST_DECL(q2srvlist);
+// every enabled server, built by LoadServers and only read after that
+server_info_t *registry;
+uint32_t registry_count;
+pthread_mutex_t q2srvlock = PTHREAD_MUTEX_INITIALIZER;
 
-threadpool pool;
+// unauthenticated connections per remote address, all reactors
+static GHashTable *pending_ips;
+static pthread_mutex_t pendinglock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t handshakes;     // in progress, all reactors
+
+// lookups into the registry, built by LoadServers and only read after that
+static GHashTable *servers_by_key;
+static GHashTable *servers_by_name;     // lowercase, to registry entries
 
-struct pollfd *sockets;
-uint32_t socket_size = 0;
-uint32_t socket_count = 0;
+threadpool pool;
+reactor_t reactors[MAX_REACTORS];
+volatile sig_atomic_t shutting_down;    // ctrl+c, every reactor stops
 
 
 /**
@@ -25,6 +36,15 @@ void LoadConfig(int argcount, char **arguments)
 	if (access(filename, F_OK) == -1) {
 	    config.port = 9988;
 	    config.threads = 2;
+	    config.reactors = 1;
+	    config.sendq_max = SENDQ_MAX * 1024;
+	    config.handshake_timeout = HANDSHAKE_TIME * 1000;
+	    config.idle_timeout = IDLE_TIME * 1000;
+	    config.stats_interval = STATS_TIME * 1000;
+	    config.pending_per_ip = PENDING_PER_IP;
+	    config.max_handshakes = MAX_HANDSHAKES;
+	    config.backlog = LISTEN_BACKLOG;
+	    config.key_cache = KEY_CACHE;
 	    config.debug = 0;
 	    strncpy(config.db_file, "server.db", sizeof(config.db_file));
 	    strncpy(config.private_key, "private.pem", sizeof(config.private_key));
@@ -65,6 +85,30 @@ void LoadConfig(int argcount, char **arguments)
 	val2 = g_key_file_get_integer(key_file, "server", "threads", &error);
 	config.threads = (val2) ? clamp(val2, 1, 8) : 2;
 
+	val2 = g_key_file_get_integer(key_file, "server", "reactors", &error);
+	config.reactors = (val2) ? clamp(val2, 1, MAX_REACTORS) : 1;
+
+	val2 = g_key_file_get_integer(key_file, "server", "sendq_max", &error);
+	config.sendq_max = ((val2) ? clamp(val2, 16, 65536) : SENDQ_MAX) * 1024;
+
+	val2 = g_key_file_get_integer(key_file, "server", "handshake_timeout", &error);
+	config.handshake_timeout = ((val2) ? clamp(val2, 1, 300) : HANDSHAKE_TIME) * 1000;
+
+	val2 = g_key_file_get_integer(key_file, "server", "idle_timeout", &error);
+	config.idle_timeout = ((val2) ? clamp(val2, 5, 3600) : IDLE_TIME) * 1000;
+
+	val2 = g_key_file_get_integer(key_file, "server", "stats_interval", &error);
+	config.stats_interval = ((val2) ? clamp(val2, 10, 86400) : STATS_TIME) * 1000;
+
+	val2 = g_key_file_get_integer(key_file, "server", "pending_per_ip", &error);
+	config.pending_per_ip = (val2) ? clamp(val2, 1, 1024) : PENDING_PER_IP;
+
+	val2 = g_key_file_get_integer(key_file, "server", "max_handshakes", &error);
+	config.max_handshakes = (val2) ? clamp(val2, 1, 4096) : MAX_HANDSHAKES;
+
+	val2 = g_key_file_get_integer(key_file, "server", "backlog", &error);
+	config.backlog = (val2) ? clamp(val2, 1, 65535) : LISTEN_BACKLOG;
+
 	val = g_key_file_get_string(key_file, "crypto", "private_key", &error);
 	if (val) {
 	    strncpy(config.private_key, val, sizeof(config.private_key));
@@ -73,6 +117,9 @@ void LoadConfig(int argcount, char **arguments)
 	    error = NULL;
 	}
 
+	val2 = g_key_file_get_integer(key_file, "crypto", "key_cache", &error);
+	config.key_cache = (val2) ? clamp(val2, 1, 1000000) : KEY_CACHE;
+
 	val = g_key_file_get_string(key_file, "crypto", "public_key", &error);
 	if (val) {
 	    strncpy(config.public_key, val, sizeof(config.public_key));
@@ -85,30 +132,18 @@ void LoadConfig(int argcount, char **arguments)
 }
 
 
-/**
- * Free memory used by the servers linked-list. Called when list is updated
- */
-void FreeServers(q2_server_t *listhead)
-{
-	q2_server_t *s;
-
-	FOR_EACH_SERVER(s) {
-		// free
-	}
-}
-
-
 /**
  * Fetch enabled servers from the database and load into a list
  */
 
 bool LoadServers(void)
 {
-    q2_server_t *temp, *server;
-    uint32_t ret;
+    q2_server_t *temp;
+    server_info_t *server;
+    uint32_t ret, room = 0;
     sqlite3_stmt *res;
 
-    List_Init(&q2srvlist);
+    registry_count = 0;
     printf("Loading servers from database...\n");
 
     if (!db) {
@@ -133,11 +168,25 @@ bool LoadServers(void)
         strncpy(temp->name, sqlite3_column_text(res, 4), sizeof(temp->name));
         strncpy(temp->ip, sqlite3_column_text(res, 5), sizeof(temp->ip));
 
-        List_Append(&q2srvlist, &temp->entry);
+        // zeroed, PublishServer() never writes the last byte of a string
+        if (registry_count == room) {
+            room = (room) ? room * 2 : 64;
+            registry = realloc(registry, room * sizeof(server_info_t));
+            memset(registry + registry_count, 0, (room - registry_count) * sizeof(server_info_t));
+        }
+        registry[registry_count++].server = temp;
     }
 
     sqlite3_finalize(res);
 
+    // the array is done moving
+    FOR_EACH_SERVER(server) {
+        server->server->info = server;
+        PublishServer(server->server);
+    }
+
+    IndexServers();
+
     FOR_EACH_SERVER(server) {
         printf("- %s %s:%d\n", server->name, server->ip, server->port);
     }
@@ -147,36 +196,117 @@ bool LoadServers(void)
 
 
 /**
- * Get the server entry based on the supplied key
+ * (Re)build the key and name lookups for the server list. Where two
+ * servers share a key or name the first one wins, like the list scans did.
  */
-q2_server_t *find_server(uint32_t key)
+void IndexServers(void)
 {
-	q2_server_t *s;
+    server_info_t *s;
+    gchar *name;
 
-	FOR_EACH_SERVER(s) {
-		if (s->key == key) {
-			return s;
-		}
-	}
+    if (servers_by_key) {
+        g_hash_table_destroy(servers_by_key);
+        g_hash_table_destroy(servers_by_name);
+    }
+
+    servers_by_key = g_hash_table_new(g_direct_hash, g_direct_equal);
+    servers_by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    FOR_EACH_SERVER(s) {
+        if (!g_hash_table_contains(servers_by_key, GUINT_TO_POINTER(s->server->key))) {
+            g_hash_table_insert(servers_by_key, GUINT_TO_POINTER(s->server->key), s->server);
+        }
+
+        name = g_ascii_strdown(s->name, -1);
+        if (g_hash_table_contains(servers_by_name, name)) {
+            g_free(name);
+            continue;
+        }
+        g_hash_table_insert(servers_by_name, name, s);
+    }
+}
+
+
+/**
+ * Player names for a listing, comma separated
+ */
+static void player_list(q2_server_t *srv, char *out, size_t size)
+{
+    q2_player_t *p;
+    size_t len = 0;
+
+    out[0] = 0;
+    FOR_EACH_PLAYER(srv, p) {
+        if (len >= size) {
+            break;
+        }
+        len += snprintf(out + len, size - len, (len) ? ", %s" : "%s", p->name);
+    }
+}
 
-	return NULL;
+
+/**
+ * Copy what's changed about a server to its registry entry, where other
+ * reactors look. Only the thread owning the server calls this, everyone
+ * else only reads the registry.
+ */
+void PublishServer(q2_server_t *srv)
+{
+    server_info_t *info = srv->info;
+    char players[PLAYERLIST_CHARS];
+
+    info->connected = srv->connected;
+    info->trusted = srv->trusted;
+    info->playercount = srv->playercount;
+    info->maxclients = srv->maxclients;
+    info->port = srv->port;
+
+    // never unterminated, even while being copied. The rows start zeroed
+    // and the last byte is never written
+    strncpy(info->ip, srv->ip, sizeof(info->ip) - 1);
+    strncpy(info->map, srv->map, sizeof(info->map) - 1);
+    strncpy(info->name, srv->name, sizeof(info->name) - 1);
+
+    if (srv->players_changed) {
+        srv->players_changed = false;
+        player_list(srv, players, sizeof(players));
+        strncpy(info->players, players, sizeof(info->players) - 1);
+    }
 }
 
 
 /**
  * Get the server entry based on the supplied key
  */
-q2_server_t *find_server_by_name(const char *name)
+q2_server_t *find_server(uint32_t key)
 {
-	q2_server_t *s;
+    if (!servers_by_key) {
+        return NULL;
+    }
 
-	FOR_EACH_SERVER(s) {
-		if (strcmp(name, s->name) == 0) {
-			return s;
-		}
-	}
+    return g_hash_table_lookup(servers_by_key, GUINT_TO_POINTER(key));
+}
+
+
+/**
+ * Get the registry entry of the server with the supplied name, ignoring
+ * case
+ */
+server_info_t *find_server_by_name(const char *name, size_t len)
+{
+    char folded[sizeof(((q2_server_t *) 0)->name)];
+    size_t i;
 
-	return NULL;
+    if (!servers_by_name || len > sizeof(folded) - 1) {
+        return NULL;    // longer than any server name
+    }
+
+    for (i=0; i<len; i++) {
+        folded[i] = tolower(name[i] & 0x7f);
+    }
+    folded[i] = 0;
+
+    return g_hash_table_lookup(servers_by_name, folded);
 }
 
 
@@ -207,119 +337,334 @@ void Pong(q2_server_t *srv)
  * When a client connects, load their public key into memory for
  * decrypting their auth challenge and encrypting their symmetric key/IV
  */
-void LoadClientPublicKey(q2_server_t *q2)
+bool LoadClientPublicKey(q2_server_t *q2)
 {
-    FILE *fp;
-    char keyfilename[200];
+    if (q2->publickey) {
+        RSA_free(q2->publickey);
+    }
+
+    q2->publickey = GetClientPublicKey(q2->key);
 
-    memset(keyfilename, 0, sizeof(keyfilename));
-    snprintf(keyfilename, sizeof(keyfilename), "keys/%d.pem", q2->key);
-    fp = fopen(keyfilename, "rb");
+    return q2->publickey != NULL;
+}
 
-    q2->publickey = RSA_new();
 
-    if (q2->publickey) {
-        q2->publickey = PEM_read_RSAPublicKey(fp, &q2->publickey, NULL, NULL);
+/**
+ * Start or stop waiting for the socket to have room for more data
+ */
+static void want_write(connection_t *c, bool want)
+{
+    if (c->want_write == want) {
+        return;
     }
 
-    fclose(fp);
+    c->want_write = want;
+    EV_Modify(c->reactor->loop, c->socket,
+            EV_READ | EV_EDGE | ((want) ? EV_WRITE : 0), c);
 }
 
 
 /**
- * A client sent us a challenge. Encrypt it and send it back along with
- * our challenge to them (and any encryption keys required)
- *
+ * Add data to the end of the connection's output queue
  */
-bool ServerAuthResponse(q2_server_t *q2, byte *challenge)
+static void queue_output(connection_t *c, const byte *data, size_t len)
 {
-    size_t len;
-    byte cl_challenge[CHALLENGE_LEN];
-    byte cipher[RSA_LEN];
+    outchunk_t *chunk = c->out_tail;
+    size_t n;
+
+    while (len) {
+        if (!chunk || chunk->len == chunk->size) {
+            chunk = malloc(sizeof(outchunk_t) + OUTCHUNK_SIZE);
+            chunk->next = NULL;
+            chunk->size = OUTCHUNK_SIZE;
+            chunk->len = 0;
+            chunk->sent = 0;
+
+            if (c->out_tail) {
+                c->out_tail->next = chunk;
+            } else {
+                c->out = chunk;
+            }
+            c->out_tail = chunk;
+        }
 
-    // generate random data for a challenge and store for later comparison
-    RAND_bytes(cl_challenge, CHALLENGE_LEN);
-    strncpy(q2->connection.cl_challenge, cl_challenge, CHALLENGE_LEN);
+        n = chunk->size - chunk->len;
+        if (len < n) {
+            n = len;
+        }
 
-    // encrypt client's challenge to send back and auth server
-    len = Sign_Client_Challenge(cipher, challenge);
-    if (len == 0) {
-        RSA_free(q2->publickey);
-        return false;
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        c->out_bytes += n;
+        data += n;
+        len -= n;
+
+        c->reactor->out_total += n;
+        c->reactor->out_queued += n;
     }
 
-    // client won't send any more data until it receives this ACK
-    MSG_WriteByte(SCMD_HELLOACK, &q2->msg);
-    MSG_WriteShort(len, &q2->msg);
-    MSG_WriteData(cipher, len, &q2->msg);
-
-    // client wants the connection encrypted
-    if (q2->connection.encrypted) {
-        RAND_bytes(q2->connection.aeskey, AESKEY_LEN);  // session key
-        RAND_bytes(q2->connection.iv, AESBLOCK_LEN);    // initialization vector
-        Encrypt_AESKey(
-                q2->publickey,
-                q2->connection.aeskey,
-                q2->connection.iv,
-                q2->connection.aeskey_cipher
-        );
-        MSG_WriteData(&q2->connection.aeskey_cipher, RSA_LEN, &q2->msg);
+    if (c->reactor->out_queued > c->reactor->out_peak) {
+        c->reactor->out_peak = c->reactor->out_queued;
+    }
+}
+
+
+/**
+ * Throw away anything still waiting to be sent
+ */
+static void free_output(connection_t *c)
+{
+    outchunk_t *chunk, *next;
+
+    for (chunk = c->out; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    c->reactor->out_queued -= c->out_bytes;
+    c->out = c->out_tail = NULL;
+    c->out_bytes = 0;
+    c->want_write = false;
+}
+
+
+/**
+ * Write as much of the output queue as the socket will take. Returns
+ * false if the connection broke and was closed.
+ */
+static bool FlushConnection(connection_t *c)
+{
+    outchunk_t *chunk;
+    ssize_t n;
+
+    while ((chunk = c->out)) {
+        n = EV_Send(c->reactor->loop, c->socket, chunk->data + chunk->sent, chunk->len - chunk->sent);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            want_write(c, true);
+            return true;
+        }
+
+        if (n == -1) {
+            perror("[error] send");
+            if (c->server) {
+                CloseConnection(c->server);
+            } else {
+                DropConnection(c);
+            }
+            return false;
+        }
+
+        chunk->sent += n;
+        c->out_bytes -= n;
+        c->reactor->out_queued -= n;
+
+        if (chunk->sent == chunk->len) {
+            c->out = chunk->next;
+            if (!c->out) {
+                c->out_tail = NULL;
+            }
+            free(chunk);
+        }
     }
 
-    MSG_WriteData(cl_challenge, CHALLENGE_LEN, &q2->msg);
-    SendBuffer(q2);
+    // everything it was owed has gone out, unless the backend is still
+    // sending some of it
+    if (c->linger) {
+        if (!EV_Sending(c->reactor->loop, c->socket)) {
+            DropConnection(c);
+            return false;
+        }
+        want_write(c, true);
+        return true;
+    }
+
+    want_write(c, false);
 
     return true;
 }
 
 
 /**
- * Decrypt the nonce the client returned to us. If it matches the client is trusted
+ * Send what iov points at. Whatever the socket won't take right now is
+ * queued and written when it drains. When closing, one best effort send
+ * is all it gets.
+ *
+ * Returns false if the connection broke, or if a q2 server is letting too
+ * much pile up. A peer's answer is only as big as the registry, it can
+ * queue all of it.
  */
-bool VerifyClientChallenge(q2_server_t *q2, msg_buffer_t *msg)
+static bool send_iov(connection_t *c, const struct iovec *iov, int count, bool closing)
 {
-    size_t len;
-    size_t count;
-    byte cipher[RSA_LEN];
-    byte plaintext[CHALLENGE_LEN];
-
-    len = MSG_ReadShort(msg);
-    MSG_ReadData(msg, &cipher, len);
-
-    count = RSA_public_decrypt(
-            len,
-            cipher,
-            plaintext,
-            q2->publickey,
-            RSA_PKCS1_PADDING
-    );
+    size_t total = 0, sent = 0;
+    ssize_t n;
+    int i;
 
-    if (count != CHALLENGE_LEN) {
-        return false;
+    for (i=0; i<count; i++) {
+        total += iov[i].iov_len;
     }
 
-    if (memcmp(q2->connection.cl_challenge, plaintext, CHALLENGE_LEN) == 0) {
-        q2->connection.e_ctx = EVP_CIPHER_CTX_new();
-        q2->connection.d_ctx = EVP_CIPHER_CTX_new();
-        q2->trusted = true;
-    } else {
-        printf("[error] %s connected but is NOT trusted, disconnecting\n", q2->name);
+    if (closing) {
+        if (!c->out) {
+            EV_Sendv(c->reactor->loop, c->socket, iov, count);
+        }
+        return true;
+    }
+
+    // nothing waiting ahead of this, try the socket directly
+    if (!c->out) {
+        do {
+            n = EV_Sendv(c->reactor->loop, c->socket, iov, count);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("[error] send");
+            return false;
+        }
+
+        sent = (n > 0) ? n : 0;
+        if (sent == total) {
+            return true;
+        }
+    }
+
+    if (c->server && c->out_bytes + total - sent > config.sendq_max) {
+        printf("[warn] %s isn't reading, %zu bytes queued, disconnecting\n",
+                c->server->name, c->out_bytes);
+        c->reactor->slow_drops++;
         return false;
     }
 
+    // whatever is left of each piece, in order
+    for (i=0; i<count; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        queue_output(c, (const byte *) iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+    want_write(c, true);
+
     return true;
 }
 
 
 /**
- * Send the contents of the message buffer to the q2 server
+ * Send msg as one frame, the length header and the payload go to the
+ * socket together. The buffer is released either way.
+ *
+ * Returns false if the connection broke or is letting too much pile up,
+ * the caller closes it.
  */
-void SendBuffer(q2_server_t *srv)
+bool SendFrame(connection_t *c, msg_buffer_t *msg, bool closing)
 {
-    byte buffer[0xffff];
-    size_t len;
+    byte header[FRAME_HEADER];
+    struct iovec iov[2];
+    bool ok;
+
+    header[0] = msg->length & 0xff;
+    header[1] = msg->length >> 8;
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER;
+    iov[1].iov_base = msg->data;
+    iov[1].iov_len = msg->length;
+    c->reactor->frames++;
+
+    ok = send_iov(c, iov, 2, closing);
+    MSG_Release(msg);
+
+    return ok;
+}
+
+
+/**
+ * Send msg as it is, without a frame header. Peers get their answer this
+ * way, see P_GetServerList(). The buffer is released either way.
+ *
+ * Returns false if the connection broke, the caller closes it.
+ */
+bool SendRaw(connection_t *c, msg_buffer_t *msg)
+{
+    struct iovec iov;
+    bool ok;
+
+    iov.iov_base = msg->data;
+    iov.iov_len = msg->length;
+
+    ok = send_iov(c, &iov, 1, false);
+    MSG_Release(msg);
+
+    return ok;
+}
+
+
+/**
+ * Write everything buffered for the q2 server as one frame, encrypted in
+ * place in the message buffer. A server that can't take it is
+ * disconnected.
+ */
+static void write_frame(q2_server_t *srv, bool closing)
+{
+    connection_t *c = &srv->connection;
+    bool encrypt;
+    ssize_t n;
+
+    if (srv->flush) {
+        srv->flush = false;
+        List_Delete(&srv->flush_entry);
+    }
+
+    if (!srv->msg.length) {
+        return;
+    }
 
+    encrypt = c->encrypted && srv->trusted;
+
+    // checked before encrypting, a GCM message dropped after it's been
+    // given a nonce would leave the other end's count behind ours
+    if (srv->msg.length + ((encrypt) ? AESBLOCK_LEN : 0) > FRAME_MAX) {
+        printf("[warn] %s: message too big for a frame (%zu bytes), dropped\n", srv->name, srv->msg.length);
+        MSG_Release(&srv->msg);
+        return;
+    }
+
+    // encrypt in place, the padding or tag needs room on the end
+    if (encrypt) {
+        MSG_Reserve(&srv->msg, srv->msg.length + AESBLOCK_LEN);
+
+        n = SymmetricEncrypt(srv, srv->msg.data, srv->msg.data, srv->msg.length);
+        if (n < 0) {
+            printf("[error] %s: encrypting message failed\n", srv->name);
+            MSG_Release(&srv->msg);
+            if (!closing) {
+                CloseConnection(srv);
+            }
+            return;
+        }
+        srv->msg.length = n;
+    }
+
+    if (!SendFrame(c, &srv->msg, closing)) {
+        CloseConnection(srv);
+    }
+}
+
+
+/**
+ * The message buffer holds output for the q2 server. Nothing is sent yet,
+ * everything a server is sent while handling one batch of events goes out
+ * together in FlushBuffers() at the end of the loop iteration.
+ */
+void SendBuffer(q2_server_t *srv)
+{
+	// nobody to send it to, don't let it pile up
 	if (!srv->connected) {
+		MSG_Release(&srv->msg);
 		return;
 	}
 
@@ -327,102 +672,236 @@ void SendBuffer(q2_server_t *srv)
 		return;
 	}
 
-	// encrypt if we should
-	if (srv->connection.encrypted && srv->trusted) {
-	    len = SymmetricEncrypt(srv, buffer, srv->msg.data, srv->msg.length);
-	    memset(&srv->msg, 0, sizeof(msg_buffer_t));
-	    memcpy(srv->msg.data, buffer, len);
-	    srv->msg.length = len;
+	// a write didn't fit, what made it in could be missing a piece
+	if (srv->msg.overflowed) {
+	    printf("[warn] %s: output didn't fit in a message, %zu bytes dropped\n", srv->name, srv->msg.length);
+	    MSG_Release(&srv->msg);
+	    return;
+	}
+
+	if (srv->flush) {
+	    srv->connection.reactor->coalesced++;
+	} else {
+	    srv->flush = true;
+	    List_Append(&srv->connection.reactor->flush, &srv->flush_entry);
 	}
 
-	send(sockets[srv->index].fd, srv->msg.data, srv->msg.length, 0);
+	// keep well clear of the end of the buffer
+	if (srv->msg.length >= FLUSH_AT) {
+	    write_frame(srv, false);
+	}
+}
 
-	memset(&srv->msg, 0, sizeof(msg_buffer_t));
 
-	return;
+/**
+ * Send everything buffered for this reactor's servers since the last
+ * call. Once per event loop iteration, or sooner for something that
+ * shouldn't wait.
+ */
+void FlushBuffers(reactor_t *r)
+{
+    q2_server_t *s, *next;
+
+    LIST_FOR_EACH_SAFE(q2_server_t, s, next, &r->flush, flush_entry) {
+        write_frame(s, false);
+    }
 }
 
 
 /**
- * Add a socket to the poll array
+ * Count another unauthenticated connection from this address. Returns
+ * false if it already has as many as it's allowed.
  */
-void add_server_socket(uint32_t socket)
+static bool pending_ip_add(const char *ip)
 {
-    sockets[socket_count].fd = socket;
-    sockets[socket_count].events = POLLIN;
-    socket_count++;
+    uint32_t count;
+    bool ok;
+
+    pthread_mutex_lock(&pendinglock);
+
+    if (!pending_ips) {
+        pending_ips = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    count = GPOINTER_TO_UINT(g_hash_table_lookup(pending_ips, ip));
+    ok = (count < config.pending_per_ip);
+    if (ok) {
+        g_hash_table_replace(pending_ips, g_strdup(ip), GUINT_TO_POINTER(count + 1));
+    }
+
+    pthread_mutex_unlock(&pendinglock);
+
+    return ok;
+}
+
+static void pending_ip_remove(const char *ip)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&pendinglock);
+
+    count = GPOINTER_TO_UINT(g_hash_table_lookup(pending_ips, ip));
+    if (count > 1) {
+        g_hash_table_replace(pending_ips, g_strdup(ip), GUINT_TO_POINTER(count - 1));
+    } else {
+        g_hash_table_remove(pending_ips, ip);
+    }
+
+    pthread_mutex_unlock(&pendinglock);
 }
 
 
 /**
- * Remove the given socket from the poll array.
- * Rebuild the array to make sure it's contiguous
+ * The connection is trusted or gone, stop holding it to the limits for
+ * connections that haven't authenticated yet
  */
-void remove_server_socket()
+void EndPending(connection_t *c)
 {
-    q2_server_t *q2;
-    uint32_t i = 1; // 0 is the listener
+    if (!c->pending) {
+        return;
+    }
 
-    FOR_EACH_SERVER(q2) {
-        if (!q2->connected) {
-            continue;
+    pending_ip_remove(c->ip);
+    c->pending = false;
+
+    if (c->handshake) {
+        __atomic_sub_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+        c->handshake = false;
+    }
+}
+
+
+/**
+ * A connection's timer went off. Until it's trusted that's the handshake
+ * deadline, after that it checks the server has been heard from lately.
+ * Servers that are still talking just get checked again later.
+ */
+static void ConnectionTimer(void *arg)
+{
+    connection_t *c = arg;
+    reactor_t *r = c->reactor;
+
+    if (c->pending) {
+        printf("[warn] %s didn't authenticate in time, closing\n", c->ip);
+
+        if (c->server) {
+            CloseConnection(c->server);
+        } else {
+            DropConnection(c);
         }
+        return;
+    }
 
-        sockets[i].fd = q2->socket;
-        sockets[i].events = POLLIN;
-        q2->index = i;
-        i++;
+    if (r->now - c->last_read >= config.idle_timeout) {
+        printf("[warn] %s hasn't been heard from in %u seconds, closing\n",
+                c->server->name, config.idle_timeout / 1000);
+        CloseConnection(c->server);
+        return;
     }
 
-    socket_count = i;
+    TIMER_Set(&r->timers, &c->timer, c->last_read + config.idle_timeout, ConnectionTimer, c);
+}
+
+
+/**
+ * Report on how a reactor is doing every so often
+ */
+static void StatsTimer(void *arg)
+{
+    reactor_t *r = arg;
+
+    PrintStats(r);
+    TIMER_Set(&r->timers, &r->stats, r->now + config.stats_interval, StatsTimer, r);
 }
 
 
 /**
  * Some random connection, notify and close it
  */
-void InvalidClient(uint32_t socket)
+void InvalidClient(connection_t *c)
 {
     printf("[warn] Invalid client, closing connection\n");
-    close(socket);
-    remove_server_socket();
+    DropConnection(c);
 }
 
 
 /**
- * Close the connection to the client and free any resources it consumed
+ * Close a connection that was never identified as a q2 server
+ */
+void DropConnection(connection_t *c)
+{
+    EndPending(c);
+    TIMER_Cancel(&c->reactor->timers, &c->timer);
+    EV_Remove(c->reactor->loop, c->socket);
+    close(c->socket);
+    free_output(c);
+    MSG_Release(c->rx);
+    free(c->rx);
+    free(c);
+}
+
+
+/**
+ * Close the connection to the client and free any resources it consumed.
+ * Only the reactor that owns the connection may call this.
  */
 void CloseConnection(q2_server_t *srv)
 {
+    if (!srv->connected) {
+        return;
+    }
+
+    // last words, usually an error explaining why
+    write_frame(srv, true);
+    MSG_Release(&srv->msg);
+    MSG_Release(srv->connection.rx);
+    srv->connection.rx_len = 0;
+    PL_Clear(srv);
+
     if (srv->publickey) {
         RSA_free(srv->publickey);
+        srv->publickey = NULL;
     }
 
     if (srv->connection.d_ctx) {
         EVP_CIPHER_CTX_free(srv->connection.d_ctx);
+        srv->connection.d_ctx = NULL;
     }
 
     if (srv->connection.e_ctx) {
         EVP_CIPHER_CTX_free(srv->connection.e_ctx);
+        srv->connection.e_ctx = NULL;
     }
 
+    EndPending(&srv->connection);
+    TIMER_Cancel(&srv->connection.reactor->timers, &srv->connection.timer);
+    EV_Remove(srv->connection.reactor->loop, srv->socket);
     close(srv->socket);
+    free_output(&srv->connection);
+    List_Delete(&srv->reactor_entry);
+
+    pthread_mutex_lock(&q2srvlock);
     srv->connected = false;
-    srv->index = 0;
+    srv->trusted = false;
+    srv->socket = -1;
+    srv->connection.socket = -1;
+    srv->connection.job = NULL;     // its result gets thrown away
+    pthread_mutex_unlock(&q2srvlock);
+    PublishServer(srv);
 
     printf("%s disconnected\n", srv->name);
-    remove_server_socket();
 }
 
 
 /**
  * Create a listener socket and return it
  */
-int get_listener_socket(void)
+int get_listener_socket(bool reuseport)
 {
     int listener;
     int yes = 1;
     int ret;
+    char port[6];
 
     struct addrinfo hints, *ai, *p;
 
@@ -431,7 +910,9 @@ int get_listener_socket(void)
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if ((ret = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
+    snprintf(port, sizeof(port), "%d", config.port);
+
+    if ((ret = getaddrinfo(NULL, port, &hints, &ai)) != 0) {
         fprintf(stderr, "selectserver: %s\n", gai_strerror(ret));
         exit(EXIT_FAILURE);
     }
@@ -445,6 +926,12 @@ int get_listener_socket(void)
         // Lose the pesky "address already in use" error message
         setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
+        // each reactor has its own listener on the same port, the kernel
+        // spreads new connections across them
+        if (reuseport) {
+            setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+        }
+
         // turn off IPv6 only, for v4 + v6 support
         yes = 0;
         setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(int));
@@ -463,10 +950,15 @@ int get_listener_socket(void)
         return -1;
     }
 
-    if (listen(listener, 10) == -1) {
+    if (listen(listener, config.backlog) == -1) {
+        close(listener);
         return -1;
     }
 
+    // accepts are drained until EAGAIN. Set even when io_uring is built in,
+    // the loop falls back to epoll or poll if the kernel can't do it
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
     return listener;
 }
 
@@ -485,180 +977,715 @@ void *get_in_addr(struct sockaddr *sa)
 
 
 /**
- * Find the currently connected server object based on the
- * supplied index.
+ * Passed to the reactor still holding a server's old connection
+ */
+typedef struct {
+    reactor_t   *reactor;
+    q2_server_t *server;
+} stale_t;
+
+/**
+ * Close a server's old connection on behalf of another reactor that
+ * received a new HELLO from it. Runs on the reactor owning the connection
  */
-static q2_server_t *get_server(uint32_t index)
+static void CloseStaleConnection(void *arg)
 {
-    q2_server_t *q2;
+    stale_t *stale = arg;
+    bool owned;
 
-    FOR_EACH_SERVER(q2) {
-        if (q2->index == index) {
-            return q2;
-        }
+    pthread_mutex_lock(&q2srvlock);
+    owned = stale->server->connected && stale->server->connection.reactor == stale->reactor;
+    pthread_mutex_unlock(&q2srvlock);
+
+    if (owned) {
+        CloseConnection(stale->server);
     }
 
-    return NULL;
+    free(stale);
 }
 
 
 /**
- * Identify the new incoming server connection
+ * Identify the new incoming server connection. The pending connection is
+ * consumed either way, it's handed to the server or closed.
  */
-static q2_server_t *new_server(msg_buffer_t *msg, uint32_t index)
+static q2_server_t *new_server(msg_buffer_t *msg, connection_t *c)
 {
     hello_t h;
     q2_server_t *q2;
+    reactor_t *owner;
+    stale_t *stale;
+    connection_t conn;
 
     if (MSG_ReadByte(msg) != CMD_HELLO) {
+        InvalidClient(c);
         return NULL;
     }
 
-    ParseHello(&h, msg);
+    if (!ParseHello(&h, msg)) {
+        InvalidClient(c);
+        return NULL;
+    }
 
-    FOR_EACH_SERVER(q2) {
-        if (h.key == q2->key) {
-            q2->index = index;
-            q2->socket = sockets[index].fd;
+    // probably a real q2 client, but not registered or enabled
+    q2 = find_server(h.key);
+    if (!q2) {
+        InvalidClient(c);
+        return NULL;
+    }
+
+    // every HELLO costs RSA work, only so many at once
+    if (__atomic_add_fetch(&handshakes, 1, __ATOMIC_RELAXED) > config.max_handshakes) {
+        __atomic_sub_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+        printf("[warn] too many handshakes in progress, refusing %s\n", c->ip);
+        DropConnection(c);
+        return NULL;
+    }
+    c->handshake = true;
+
+    // claim the server for this reactor
+    while (true) {
+        pthread_mutex_lock(&q2srvlock);
+        owner = (q2->connected) ? q2->connection.reactor : NULL;
+        if (!owner) {
             q2->connected = true;
-            q2->port = h.port;
-            q2->maxclients = h.max_clients;
-            q2->connection.encrypted = h.encrypted;
+            q2->connection.reactor = c->reactor;
+        }
+        pthread_mutex_unlock(&q2srvlock);
+
+        if (!owner) {
+            break;
+        }
+
+        // reconnected before we noticed the old connection died
+        if (owner == c->reactor) {
+            CloseConnection(q2);
+            continue;
+        }
+
+        // the old connection belongs to another reactor, have it closed
+        // there and let the server try again
+        printf("[warn] %s still connected on reactor %d, dropping it\n", q2->name, owner->id);
+        stale = malloc(sizeof(stale_t));
+        stale->reactor = owner;
+        stale->server = q2;
+        EV_Post(owner->loop, CloseStaleConnection, stale);
+        DropConnection(c);
+        return NULL;
+    }
+
+    // take over the socket and any unparsed frames from the pending
+    // connection. The old buffer was left behind by the last connection
+    free(q2->connection.rx);
+    memset(&conn, 0, sizeof(connection_t));
+    conn.socket = c->socket;
+    conn.reactor = c->reactor;
+    conn.server = q2;
+    conn.rx = c->rx;
+    conn.rx_len = c->rx_len;
+    conn.pending = c->pending;
+    conn.handshake = c->handshake;
+    conn.last_read = c->last_read;
+    memcpy(conn.ip, c->ip, sizeof(conn.ip));
+    q2->connection = conn;
+    EV_Modify(c->reactor->loop, c->socket, EV_READ | EV_EDGE, &q2->connection);
+
+    // it keeps its deadline
+    TIMER_Move(&q2->connection.timer, &c->timer);
+    q2->connection.timer.arg = &q2->connection;
+    List_Append(&c->reactor->servers, &q2->reactor_entry);
+    free(c);
+
+    // kept after it disconnects, other reactors might be looking
+    if (!q2->players) {
+        q2->players = malloc(sizeof(player_table_t));
+        memset(q2->players, 0, sizeof(player_table_t));
+    }
+
+    q2->socket = q2->connection.socket;
+    MSG_Release(&q2->msg);
+    q2->trusted = false;
+    q2->port = h.port;
+    q2->maxclients = h.max_clients;
+    q2->connection.encrypted = h.encrypted;
+    PublishServer(q2);
+
+    if (h.encrypted > CIPHER_GCM) {
+        SendError(q2, ERR_ENCRYPTION, -1, "Unsupported cipher");
+        CloseConnection(q2);
+
+        return NULL;
+    }
+
+    if (!LoadClientPublicKey(q2)) {
+        SendError(q2, ERR_UNAUTHORIZED, -1, "No public key on file");
+        CloseConnection(q2);
+
+        return NULL;
+    }
+
+    if (!ServerAuthResponse(q2, h.challenge)) {
+        SendError(q2, ERR_ENCRYPTION, -1,
+                "Problems encrypting sv_challenge"
+        );
+        CloseConnection(q2);
+
+        return NULL;
+    }
+
+    return q2;
+}
+
+
+/**
+ * Start tracking a newly accepted socket. We don't know who it is until
+ * it says HELLO, so it just gets a bare connection for now
+ */
+static void NewConnection(reactor_t *r, int newsocket, struct sockaddr_storage *remoteaddr)
+{
+    connection_t *c;
+    char remote_addr[INET6_ADDRSTRLEN];
+
+    inet_ntop(
+            remoteaddr->ss_family,
+            get_in_addr((struct sockaddr*) remoteaddr),
+            remote_addr,
+            INET6_ADDRSTRLEN
+    );
+
+    if (!pending_ip_add(remote_addr)) {
+        printf("[warn] too many unauthenticated connections from %s\n", remote_addr);
+        close(newsocket);
+        return;
+    }
+
+    c = malloc(sizeof(connection_t));
+    memset(c, 0, sizeof(connection_t));
+    c->socket = newsocket;
+    c->reactor = r;
+    c->rx = malloc(sizeof(msg_buffer_t));
+    memset(c->rx, 0, sizeof(msg_buffer_t));
+    c->last_read = r->now;
+    memcpy(c->ip, remote_addr, sizeof(c->ip));
+
+    if (!EV_Add(r->loop, newsocket, EV_READ | EV_EDGE, c)) {
+        pending_ip_remove(remote_addr);
+        close(newsocket);
+        free(c->rx);
+        free(c);
+        return;
+    }
+
+    c->pending = true;
+    TIMER_Set(&r->timers, &c->timer, r->now + config.handshake_timeout, ConnectionTimer, c);
+
+    if (config.debug) {
+        printf("New connection from %s\n", remote_addr);
+    }
+}
+
+
+/**
+ * Note how many connections one listener wakeup produced
+ */
+static void count_accepts(reactor_t *r, uint32_t count)
+{
+    r->accepted += count;
+    r->accept_wakeups++;
+
+    if (count > r->accept_peak) {
+        r->accept_peak = count;
+    }
+}
+
+
+/**
+ * Start watching the listener again after resting it
+ */
+static void ResumeAccepts(void *arg)
+{
+    reactor_t *r = arg;
+
+    EV_Modify(r->loop, r->listener, EV_ACCEPT, NULL);
+}
+
+
+/**
+ * An accept failed. Out of descriptors or memory the listener stays
+ * ready until one is freed, so rather than spin on it, stop watching it
+ * for ACCEPT_BACKOFF ms. Returns false for anything else, the listener
+ * carries on.
+ */
+static bool accept_failed(reactor_t *r, int err)
+{
+    r->accept_errors++;
+
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM) {
+        printf("[error] accept: %s\n", strerror(err));
+        return false;
+    }
+
+    // once until a connection gets through again
+    if (!r->accept_starved) {
+        printf("[warn] accept: %s, not accepting for a while\n", strerror(err));
+        r->accept_starved = true;
+    }
+
+    EV_Modify(r->loop, r->listener, 0, NULL);
+    TIMER_Set(&r->timers, &r->accept_timer, r->now + ACCEPT_BACKOFF, ResumeAccepts, r);
+
+    return true;
+}
+
 
-            LoadClientPublicKey(q2);
+/**
+ * Accept everything waiting on the listening socket. A restart brings
+ * every q2 server back at once, so drain the backlog rather than taking
+ * one per wakeup. Stop after ACCEPT_BATCH so established servers still
+ * get serviced, the listener stays ready and we'll be back.
+ */
+static void AcceptConnection(reactor_t *r)
+{
+    int newsocket;
+    struct sockaddr_storage remoteaddr;
+    socklen_t addrlen;
+    uint32_t count;
+
+    for (count = 0; count < ACCEPT_BATCH; count++) {
+        addrlen = sizeof(remoteaddr);
+        newsocket = accept4(
+                r->listener,
+                (struct sockaddr *) &remoteaddr,
+                &addrlen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
 
-            if (!ServerAuthResponse(q2, h.challenge)) {
-                SendError(q2, ERR_ENCRYPTION, -1,
-                        "Problems encrypting sv_challenge"
-                );
+        if (newsocket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
 
-                return NULL;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                accept_failed(r, errno);
             }
 
-            return q2;
             break;
         }
+
+        r->accept_starved = false;
+        NewConnection(r, newsocket, &remoteaddr);
     }
 
-    return NULL;
+    count_accepts(r, count);
 }
 
 
 /**
- * Main program loop. Listen for incoming connections, process data from existing
- * connections.
+ * The kernel already accepted this one for us (io_uring). Without a
+ * socket the accept failed and stopped, it has to be started again.
  */
-void RunServer(void)
+static void AcceptedConnection(reactor_t *r, int newsocket, int err)
 {
-    uint32_t listener;
-    uint32_t newsocket;
-    uint32_t peer;
+    struct sockaddr_storage remoteaddr;
+    socklen_t addrlen;
 
-    q2_server_t *q2;
-    msg_buffer_t msg;
+    if (newsocket == -1) {
+        if (!accept_failed(r, err)) {
+            ResumeAccepts(r);
+        }
+        return;
+    }
 
-    uint32_t poll_count = 0;
+    r->accept_starved = false;
 
-    struct sockaddr_storage remoteaddr;
-    socklen_t addrlen;
-    char remote_addr[INET6_ADDRSTRLEN];
+    addrlen = sizeof(remoteaddr);
+    memset(&remoteaddr, 0, sizeof(remoteaddr));
+    getpeername(newsocket, (struct sockaddr *) &remoteaddr, &addrlen);
 
-    pool = thpool_init(config.threads);
+    count_accepts(r, 1);
+    NewConnection(r, newsocket, &remoteaddr);
+}
+
+
+/**
+ * Handle a message from a connection. Returns the connection to keep
+ * reading from, which changes once a pending connection is identified,
+ * or NULL if it was closed while handling the message.
+ */
+static connection_t *HandleMessage(connection_t *c, msg_buffer_t *msg)
+{
+    uint32_t magic;
+    q2_server_t *q2 = c->server;
+
+    c->last_read = c->reactor->now;
 
-    FOR_EACH_SERVER(q2) {
-        socket_size++;
+    // already answered, anything else it says is ignored
+    if (c->linger) {
+        return c;
     }
 
-    // add 5 or so extra for temporary peer connections
-    sockets = malloc(socket_size * sizeof(struct pollfd) + 5);
+    if (!q2) {
+        magic = MSG_ReadLong(msg);
 
-    listener = get_listener_socket();
-    if (listener == -1) {
-        fprintf(stderr, "[error] problems getting listening socket\n");
-        exit(EXIT_FAILURE);
+        // closed once the answer has been sent
+        if (magic == MAGIC_PEER) {
+            if (ParsePeerRequest(msg, c) && (c->out || EV_Sending(c->reactor->loop, c->socket))) {
+                c->linger = true;
+                want_write(c, true);
+                return c;
+            }
+            DropConnection(c);
+            return NULL;
+        }
+
+        if (magic != MAGIC_CLIENT) {
+            InvalidClient(c);
+            return NULL;
+        }
+
+        q2 = new_server(msg, c);
+        if (!q2) {
+            return NULL;
+        }
+    }
+
+    q2->lastcontact = time(NULL);
+    ParseMessage(q2, msg);
+
+    return (q2->connected) ? &q2->connection : NULL;
+}
+
+
+/**
+ * The connection was closed by the other end, or broke
+ */
+static void ConnectionLost(connection_t *c, ssize_t len)
+{
+    if (!c->server) {
+        DropConnection(c);
+        return;
+    }
+
+    if (len == 0) {
+        printf("[warn] %s disconnected abnormally\n", c->server->name);
     }
 
-    sockets[0].fd = listener;
-    sockets[0].events = POLLIN;
-    socket_count = 1;
+    CloseConnection(c->server);
+}
+
+
+/**
+ * Handle every complete frame waiting in the connection's buffer. Each one
+ * is parsed where it sits, a partial frame at the end is moved to the
+ * front to be completed by the next read.
+ *
+ * Returns the connection, which is a different one after a HELLO, or
+ * NULL if the connection was closed.
+ */
+static connection_t *ParseFrames(connection_t *c)
+{
+    msg_buffer_t *rx = c->rx;
+    size_t start = 0;
+    size_t len;
+
+    while (c->rx_len - start >= FRAME_HEADER) {
+        // the rest waits for the handshake step to finish
+        if (c->job) {
+            break;
+        }
+
+        len = rx->data[start] | (rx->data[start + 1] << 8);
+
+        if (len > FRAME_MAX) {
+            printf("[warn] oversized frame (%zu bytes)\n", len);
+            ConnectionLost(c, -1);
+            return NULL;
+        }
+
+        if (c->rx_len - start - FRAME_HEADER < len) {
+            break;
+        }
+
+        // the reader works on [index, length), the frame's payload
+        rx->index = start + FRAME_HEADER;
+        rx->length = rx->index + len;
+        rx->overflowed = false;
+        start = rx->length;
+
+        // the buffer moves with the connection if it's promoted
+        c = HandleMessage(c, rx);
+        if (!c) {
+            return NULL;
+        }
+    }
+
+    if (start) {
+        c->rx_len -= start;
+        memmove(rx->data, rx->data + start, c->rx_len);
+    }
+
+    return c;
+}
+
+
+/**
+ * A handshake step finished, handle any frames that came in meanwhile.
+ * Runs on the reactor owning the connection.
+ */
+void ResumeConnection(connection_t *c)
+{
+    if (!c->rx_len) {
+        return;
+    }
+
+    c = ParseFrames(c);
+
+    if (c && !c->rx_len) {
+        MSG_Release(c->rx);
+    }
+}
+
+
+/**
+ * Frames stop being handled while a handshake step runs. A full buffer
+ * then means the other end isn't waiting for us like it should.
+ */
+static bool rx_full(connection_t *c)
+{
+    if (c->rx_len < c->rx->size) {
+        return false;
+    }
+
+    printf("[warn] %s sent too much during the handshake\n", c->ip);
+    ConnectionLost(c, -1);
+    return true;
+}
+
+
+/**
+ * Data is waiting on a connection. Sockets are edge-triggered, so keep
+ * reading until the kernel has nothing left for us.
+ */
+static void ReadConnection(connection_t *c)
+{
+    ssize_t len;
 
     while (true) {
-        poll_count = poll(sockets, socket_count, POLL_BLOCK);
-        if (poll_count == -1) {
-            perror("[error] poll");
+        // borrowed only while there's data to go through
+        MSG_Reserve(c->rx, MSG_MAXSIZE);
+        if (rx_full(c)) {
+            return;
+        }
+
+        len = recv(c->socket, c->rx->data + c->rx_len,
+                c->rx->size - c->rx_len, MSG_DONTWAIT);
+
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!c->rx_len) {
+                MSG_Release(c->rx);
+            }
+            return;
+        }
+
+        if (len <= 0) {
+            if (len == -1) {
+                perror("[error] recv");
+            }
+
+            ConnectionLost(c, len);
+            return;
+        }
+
+        c->rx_len += len;
+
+        c = ParseFrames(c);
+        if (!c) {
+            return;
+        }
+    }
+}
+
+
+/**
+ * Data the kernel already received for us (io_uring)
+ */
+static void ReceiveData(connection_t *c, byte *data, ssize_t len)
+{
+    size_t n;
+
+    if (len <= 0) {
+        if (len < 0) {
+            errno = -len;
+            perror("[error] recv");
+        }
+
+        ConnectionLost(c, len);
+        return;
+    }
+
+    // a partial frame can leave less room than was received
+    while (len > 0) {
+        MSG_Reserve(c->rx, MSG_MAXSIZE);
+        if (rx_full(c)) {
+            return;
+        }
+
+        n = c->rx->size - c->rx_len;
+        if ((size_t) len < n) {
+            n = len;
+        }
+
+        memcpy(c->rx->data + c->rx_len, data, n);
+        c->rx_len += n;
+        data += n;
+        len -= n;
+
+        c = ParseFrames(c);
+        if (!c) {
+            return;
+        }
+    }
+
+    if (!c->rx_len) {
+        MSG_Release(c->rx);
+    }
+}
+
+
+/**
+ * Reactor thread. Listen for incoming connections, process data from the
+ * connections this reactor owns.
+ */
+void *ServerThread(void *arg)
+{
+    reactor_t *r = arg;
+    int count, i;
+    ev_event_t events[EV_MAXEVENTS];
+
+    r->now = r->started = Milliseconds();
+    TIMER_Init(&r->timers, r->now);
+    TIMER_Set(&r->timers, &r->stats, r->now + config.stats_interval, StatsTimer, r);
+
+    while (!shutting_down) {
+        count = EV_Wait(r->loop, events, EV_MAXEVENTS, TIMER_Timeout(&r->timers, r->now));
+        if (count == -1) {
+            perror("[error] event wait");
             exit(EXIT_FAILURE);
         }
 
-        for (int i=0; i<socket_count; i++) {
-            if (sockets[i].revents & POLLIN) {
-                if (sockets[i].fd == listener) {
-                    addrlen = sizeof(remoteaddr);
-                    newsocket = accept(listener, (struct sockaddr *) &remoteaddr, &addrlen);
-
-                    if (newsocket == -1) {
-                        perror("[error] accept");
-                    } else {
-                        add_server_socket(newsocket);
-
-                        printf("New connection from %s\n",
-                                inet_ntop(
-                                        remoteaddr.ss_family,
-                                        get_in_addr((struct sockaddr*) &remoteaddr),
-                                        remote_addr,
-                                        INET6_ADDRSTRLEN
-                                )
-                        );
-                    }
-                } else {    // just a client
-                    q2 = get_server(i);
-
-                    memset(&msg, 0, sizeof(msg_buffer_t));
-                    msg.length = recv(sockets[i].fd, msg.data, sizeof(msg.data), 0);
-
-
-                    if (msg.length <= 0) {
-                        if (msg.length == 0) {
-                            printf("[warn] %s disconnected abnormally\n", q2->name);
-                        } else {
-                            perror("[error] recv");
-                        }
-
-                        q2->connected = false;
-                        q2->index = 0;
-                        q2->socket = 0;
-                        close(sockets[i].fd);
-                        remove_server_socket();
-
-                    } else {
-                        if (!q2) {
-                            peer = MSG_ReadLong(&msg);
-
-                            if (peer == MAGIC_PEER) {
-                                ParsePeerRequest(&msg, i);
-                                remove_server_socket();
-                                continue;
-                            }
-
-                            if (peer != MAGIC_CLIENT) {
-                                InvalidClient(sockets[i].fd);
-                                continue;
-                            }
-
-                            q2 = new_server(&msg, i);
-
-                            // probably a real q2 client, but not registered or enabled
-                            if (!q2) {
-                                InvalidClient(sockets[i].fd);
-                                continue;
-                            }
-                        }
-
-                        ParseMessage(q2, &msg);
-                    }
+        r->now = Milliseconds();
+
+        for (i=0; i<count; i++) {
+            // socket was closed while handling an earlier event
+            if (!events[i].events) {
+                continue;
+            }
+
+            if (events[i].events & EV_ACCEPT) {
+                AcceptedConnection(r, events[i].fd, -events[i].len);
+                continue;
+            }
+
+            if (!events[i].data) {
+                AcceptConnection(r);
+                continue;
+            }
+
+            // room to send more, q2 servers and answered peers queue output
+            if (events[i].events & EV_WRITE) {
+                if (!FlushConnection(events[i].data)) {
+                    continue;
                 }
             }
+
+            if (events[i].events & EV_DATA) {
+                ReceiveData(events[i].data, events[i].buf, events[i].len);
+            } else if (events[i].events & (EV_READ | EV_ERROR)) {
+                ReadConnection(events[i].data);
+            }
+        }
+
+        TIMER_Run(&r->timers, r->now);
+        FlushBuffers(r);
+
+        if (r->id == 0 && reload_keys) {
+            reload_keys = 0;
+            LoadPrivateKey();
         }
     }
+
+    return NULL;
+}
+
+
+/**
+ * Main program loop. Start a reactor for each event loop thread wanted,
+ * the first one runs on the main thread. Returns once they've all been stopped
+ * by ctrl+c.
+ */
+void RunServer(void)
+{
+    reactor_t *r;
+    server_info_t *srv;
+    uint32_t i;
+
+    pool = thpool_init(config.threads);
+    PrewarmPublicKeys();
+
+    for (i=0; i<config.reactors; i++) {
+        r = &reactors[i];
+        r->id = i;
+        List_Init(&r->servers);
+        List_Init(&r->flush);
+
+        r->loop = EV_CreateLoop();
+        if (!r->loop) {
+            exit(EXIT_FAILURE);
+        }
+
+        r->listener = get_listener_socket(config.reactors > 1);
+        if (r->listener == -1) {
+            fprintf(stderr, "[error] problems getting listening socket\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // the listener is the only socket registered without a connection
+        EV_Add(r->loop, r->listener, EV_ACCEPT, NULL);
+    }
+
+    printf("Using %d %s event loop(s)\n", config.reactors, EV_BackendName(reactors[0].loop));
+
+    for (i=1; i<config.reactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, ServerThread, &reactors[i])) {
+            perror("[error] pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    reactors[0].thread = pthread_self();
+    ServerThread(&reactors[0]);
+
+    // interrupted, once every reactor has stopped nothing else is touching
+    // their counters or sockets
+    for (i=1; i<config.reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+
+    for (i=0; i<config.reactors; i++) {
+        PrintStats(&reactors[i]);
+    }
+
+    FOR_EACH_SERVER(srv) {
+        if (srv->connected) {
+            close(srv->server->socket);
+        }
+    }
+
+    CloseDatabase();
 }
 
 
@@ -668,8 +1695,10 @@ void RunServer(void)
 int main(int argc, char **argv)
 {
 	signal(SIGINT, SignalCatcher);
+	signal(SIGHUP, SignalCatcher);
 
 	LoadConfig(argc, argv);
+	LoadPrivateKey();
 	OpenDatabase();
 	LoadServers();
 	RunServer();
@@ -18,9 +18,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/stat.h>
 #endif
 
 #include <openssl/ssl.h>
@@ -36,8 +38,15 @@
 #include <stdbool.h>
 
 #include <errno.h>
+#include <ctype.h>
 #include <signal.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#if USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "list.h"
 #include "threadpool.h"
@@ -55,23 +64,49 @@
 #define random()        ((rand () & 0x7fff) / ((float)0x7fff))
 #define ROUNDF(f,c)     (((float)((int)((f) * (c))) / (c)))
 
-#define PORT        "9988"
 #define MAXLINE     1390
 #define CONFIGFILE  "q2a.ini"
 #define VER_REQ     0
 #define POLL_BLOCK  (-1)
+#define EV_MAXEVENTS 256   // max ready sockets handled per wakeup
+
+#define OUTCHUNK_SIZE   (16 * 1024)             // output queue allocation unit
+#define SENDQ_MAX       512                     // default output queue limit, KB
+#define HANDSHAKE_TIME  10                      // default seconds to become trusted
+#define IDLE_TIME       120                     // default seconds a server can go quiet
+#define STATS_TIME      300                     // default seconds between stats reports
+#define PENDING_PER_IP  8                       // default unauthenticated connections per address
+#define MAX_HANDSHAKES  32                      // default HELLOs being verified at once
+#define LISTEN_BACKLOG  128                     // default listen() queue, capped by somaxconn
+#define KEY_CACHE       1024                    // default client public keys kept parsed
+#define ACCEPT_BATCH    64                      // most connections accepted per wakeup
+#define ACCEPT_BACKOFF  100                     // ms the listener rests when out of descriptors
+#define FLUSH_AT        (32 * 1024)             // send right away once this much is buffered
+
+#define FRAME_HEADER    2                       // uint16 length before every message
+#define FRAME_MAX       (0xffff - FRAME_HEADER) // largest payload a frame can carry
 
 #define RSA_BITS        2048   // encryption key length
 #define CHALLENGE_LEN   16     // bytes
 #define AESKEY_LEN      16     // bytes
 #define AESBLOCK_LEN    16
+#define AEAD_NONCE_LEN  12     // GCM nonce, from the session IV and a counter
+#define AEAD_TAG_LEN    16     // GCM tag after each encrypted message
+#define NONCE_OUTGOING  (1ULL << 63)    // server to client half of the nonce space
+
+#define CIPHER_NONE     0      // hello's encrypted byte, what the client wants
+#define CIPHER_CBC      1      // AES-128-CBC, same IV every message
+#define CIPHER_GCM      2      // AES-128-GCM, counter nonces and a tag
 #define RSA_LEN         256    // 2048 bits
 
 #define MAX_STRING_CHARS    1024
 #define MAX_TELE_NAME       15
 #define MAX_NAME_CHARS      15    // playername
 #define MAX_USERINFO_CHARS  512
+#define MAX_PLAYERS         256   // client_id is a byte
+#define PLAYERLIST_CHARS    80    // published player names, enough for a listing line
 #define MAX_THREADS         256
+#define MAX_REACTORS        64
 
 #define CMD_ONLINE  "sv !remote_online"
 
@@ -88,8 +123,17 @@ typedef unsigned char byte;
 
 #define RFL(f)      ((remote.flags & RFL_##f) != 0)
 
+// s is a server_info_t, s->server has the rest
 #define FOR_EACH_SERVER(s) \
-    LIST_FOR_EACH(q2_server_t, s, &q2srvlist, entry)
+    for (s = registry; s < registry + registry_count; s++)
+
+// only the servers connected through reactor r
+#define FOR_EACH_REACTOR_SERVER(r, s) \
+    LIST_FOR_EACH(q2_server_t, s, &(r)->servers, reactor_entry)
+
+// when the loop body might close s
+#define FOR_EACH_REACTOR_SERVER_SAFE(r, s, n) \
+    LIST_FOR_EACH_SAFE(q2_server_t, s, n, &(r)->servers, reactor_entry)
 
 /**
  * Each server message
@@ -102,12 +146,64 @@ struct message {
 };
 
 
+/**
+ * Storage is borrowed from a pool when it's needed, see MSG_Reserve()
+ */
 typedef struct {
     size_t      length;
     uint32_t    index;
-    byte        data[0xffff];
+    bool        overflowed; // read past length or a write didn't fit, see MSG_ReadSpan()
+    size_t      size;       // room in data
+    byte        *data;      // NULL while empty
 } msg_buffer_t;
 
+/**
+ * A string still sitting in a message buffer (see MSG_ReadStringView())
+ * or some other string. Not terminated, and only good as long as what
+ * it points into is.
+ */
+typedef struct {
+    const char  *data;
+    size_t      len;
+} msg_string_t;
+
+/**
+ * Little-endian loads from wherever in a buffer, aligned or not
+ */
+static inline uint16_t LittleShort(const byte *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap16(v);
+#endif
+    return v;
+}
+
+static inline uint32_t LittleLong(const byte *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+#define MSG_CLASSES     4                       // block sizes in the pool
+#define MSG_MAXSIZE     0x10000                 // biggest block, fits any frame
+#define MSG_POOL_KEEP   32                      // free blocks kept per size per thread
+
+#define ARENA_BLOCK     0x4000                  // scratch memory comes in chunks this big
+
+/**
+ * A point in the thread's scratch arena to go back to, see ARENA_Mark()
+ */
+typedef struct {
+    void        *block;
+    size_t      used;
+} arena_mark_t;
+
 msg_buffer_t msg;
 
 
@@ -116,8 +212,17 @@ msg_buffer_t msg;
  */
 typedef struct {
     uint8_t threads;        // additional threads
+    uint8_t reactors;       // event loop threads
     uint8_t debug;
     uint16_t port;
+    uint32_t sendq_max;     // bytes queued for a server before it's dropped
+    uint32_t handshake_timeout;  // ms from accept to trusted
+    uint32_t idle_timeout;       // ms without hearing from a server before dropping it
+    uint32_t stats_interval;     // ms between stats reports
+    uint32_t pending_per_ip;     // untrusted connections allowed from one address
+    uint32_t max_handshakes;     // servers between HELLO and trusted, all reactors
+    uint32_t backlog;            // listen() queue length
+    uint32_t key_cache;          // client public keys kept parsed
     char db_file[50];       // sqlite db file
     char private_key[50];   // our key pair
     char public_key[50];    // all clients need this too
@@ -125,27 +230,178 @@ typedef struct {
 
 
 /**
- * Represents an active player
+ * Userinfo keys that are looked up often enough to find them when the
+ * string is first seen, see PL_Info()
+ */
+typedef enum {
+    INFO_NAME,
+    INFO_IP,
+    INFO_SKIN,
+    INFO_HAND,
+    INFO_KEYS
+} info_key_t;
+
+
+/**
+ * Represents an active player. Just what gets looked at all the time, the
+ * userinfo string is kept off to the side, see player.c
  */
 typedef struct {
-    uint8_t client_id;
-    char name[MAX_NAME_CHARS];
-    char userinfo[MAX_USERINFO_CHARS];
+    char name[MAX_NAME_CHARS + 1];
     uint32_t kill_count;
     uint32_t death_count;
     uint32_t suicide_count;
     uint32_t invite_count;      // how many times this player used invite
     uint32_t invite_frame;      // throttle invite cmd to this frame
+    uint8_t client_id;
+    const char *userinfo;       // shared, from PL_Intern()
 } q2_player_t;
 
 
+/**
+ * Every player on a server, by client_id. The bitmap says which slots
+ * are in use so only those are visited.
+ */
+typedef struct {
+    uint64_t    used[MAX_PLAYERS / 64];
+    q2_player_t slot[MAX_PLAYERS];
+} player_table_t;
+
+#define FOR_EACH_PLAYER(srv, p) \
+    for (p = PL_Next(srv, NULL); p; p = PL_Next(srv, p))
+
+
+typedef struct q2_server_s q2_server_t;
+typedef struct ev_loop_s ev_loop_t;
+typedef struct uring_s uring_t;
+
+
+/**
+ * Event flags for sockets registered with the event loop
+ */
+#define EV_READ     (1 << 0)
+#define EV_WRITE    (1 << 1)
+#define EV_ERROR    (1 << 2)
+#define EV_EDGE     (1 << 3)  // edge-triggered, ignored by poll backend
+#define EV_ACCEPT   (1 << 4)  // listening socket / new connection
+#define EV_DATA     (1 << 5)  // data already received (io_uring)
+
+/**
+ * A ready socket, as returned from EV_Wait()
+ */
+typedef struct {
+    uint32_t    events;
+    int         fd;
+    void        *data;      // whatever was registered with the socket
+    byte        *buf;       // EV_DATA only
+    ssize_t     len;        // EV_DATA only, <= 0 means closed. -errno for a failed EV_ACCEPT
+} ev_event_t;
+
+
+/**
+ * Something to do later on a reactor's thread, see timer.c. Embedded in
+ * whatever it belongs to, nothing is allocated.
+ */
+typedef struct {
+    list_t      entry;      // in a wheel slot
+    uint64_t    expires;    // tick it's due
+    bool        active;
+    void        (*func)(void *arg);
+    void        *arg;
+} q2_timer_t;
+
+#define TIMER_TICK      10                      // ms per wheel tick
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)       // per level
+#define TIMER_LEVELS    4                       // 2^24 ticks, about 46 hours
+
+/**
+ * Timers for one reactor, sorted into slots by how far off they are
+ */
+typedef struct {
+    list_t      slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t    used[TIMER_LEVELS];     // bitmap of non-empty slots
+    uint64_t    tick;                   // next tick to run
+    uint32_t    count;                  // active timers
+} timer_wheel_t;
+
+
+/**
+ * Part of a connection's output queue, data the socket wouldn't take yet
+ */
+typedef struct outchunk_s {
+    struct outchunk_s   *next;
+    size_t              size;       // room in data
+    size_t              len;        // bytes in data
+    size_t              sent;       // bytes already written to the socket
+    byte                data[];
+} outchunk_t;
+
+
+/**
+ * An event loop thread. Each one has its own listener and owns every
+ * connection accepted on it, nothing else touches those connections.
+ */
+typedef struct {
+    uint32_t    id;
+    pthread_t   thread;
+    ev_loop_t   *loop;
+    int         listener;
+    list_t      servers;        // connected q2 servers owned by this reactor
+    timer_wheel_t timers;
+    q2_timer_t  stats;          // periodic report
+    uint64_t    now;            // ms, when the loop last woke up
+    list_t      flush;          // servers with output to send this iteration
+    uint64_t    out_queued;     // bytes waiting in output queues right now
+    uint64_t    out_peak;       // most ever waiting at once
+    uint64_t    out_total;      // bytes that had to be queued
+    uint32_t    slow_drops;     // servers dropped for not reading
+    uint64_t    frames;         // frames written to sockets
+    uint64_t    coalesced;      // messages that shared a frame with another
+    uint64_t    broadcasts;     // sent to every server from here
+    uint64_t    fanout_total;   // us from sending a broadcast to every server having it
+    uint64_t    fanout_peak;    // us, slowest broadcast
+    uint64_t    started;        // when the loop started, ms
+    uint64_t    accepted;       // connections accepted
+    uint64_t    accept_wakeups; // times the listener was ready
+    uint32_t    accept_peak;    // most accepted in a single wakeup
+    uint32_t    accept_errors;  // failed accepts other than EAGAIN
+    q2_timer_t  accept_timer;   // listener resting, see accept_failed()
+    bool        accept_starved; // out of descriptors, warned already
+    uint64_t    signs;          // handshake challenges signed
+    uint64_t    sign_total;     // us spent signing them
+    uint64_t    sign_peak;      // us, slowest one
+} reactor_t;
+
+
+/**
+ * Handshake steps, see handshake.c
+ */
+typedef enum {
+    HS_HELLO,
+    HS_SIGNING,
+    HS_CHALLENGED,
+    HS_VERIFYING,
+    HS_TRUSTED,
+} hs_state_t;
+
+
 /**
  * This represents a new q2 server connection,
  * before we know which server it belongs with
  */
 typedef struct {
     uint32_t            thread_id;
-    uint32_t            socket;
+    int                 socket;
+    reactor_t           *reactor;   // event loop thread that owns this socket
+    q2_server_t         *server;    // NULL until identified by HELLO
+    msg_buffer_t        *rx;        // incoming frames, reassembled
+    size_t              rx_len;     // bytes waiting in rx
+    outchunk_t          *out;       // output queue, oldest first
+    outchunk_t          *out_tail;
+    size_t              out_bytes;  // unsent bytes in the output queue
+    bool                want_write; // waiting for the socket to drain
+    bool                linger;     // close once the output queue drains
     SSL                 *ssl;
     SSL_CTX             *ssl_context;
     const SSL_METHOD    *ssl_method;
@@ -156,10 +412,18 @@ typedef struct {
     byte                iv[AESBLOCK_LEN];
     EVP_CIPHER_CTX      *e_ctx;     // encrypting context
     EVP_CIPHER_CTX      *d_ctx;     // decrypting context
-    bool                encrypted;
+    uint8_t             encrypted;  // CIPHER_*
+    uint64_t            send_seq;   // GCM messages sent, the next nonce
+    uint64_t            recv_seq;   // GCM messages received
     byte                cl_challenge[CHALLENGE_LEN];
     uint32_t            ping_count;
-    list_t              entry;
+    char                ip[INET6_ADDRSTRLEN];
+    bool                pending;    // not trusted yet, in the reactor's pending list
+    bool                handshake;  // HELLO accepted, counts against max_handshakes
+    hs_state_t          state;      // how far through the handshake
+    struct hs_job_s     *job;       // handshake step running on the threadpool
+    uint64_t            last_read;  // ms, last complete frame
+    q2_timer_t          timer;      // handshake deadline, then idle check
 } connection_t;
 
 
@@ -172,19 +436,40 @@ typedef struct {
     uint32_t    version;                  // the q2admin game version
     uint16_t    port;                     // the port q2 is running on the client
     uint8_t     max_clients;              // max players on that server
-    uint8_t     encrypted;                // is this connection encrypted?
+    uint8_t     encrypted;                // which cipher, CIPHER_NONE if not encrypted
     byte        challenge[CHALLENGE_LEN]; // random data to auth the server
 } hello_t;
 
+#define HELLO_LEN   (4 + 4 + 2 + 1 + 1 + CHALLENGE_LEN)   // on the wire
+
+
+/**
+ * The part of each server that gets looked at when walking all of them
+ * (listings, peers, broadcasts). These sit together in one array so a
+ * walk doesn't touch each server's much bigger connection state. The
+ * owning reactor copies changes in with PublishServer().
+ */
+typedef struct {
+    bool            connected;
+    bool            trusted;
+    uint8_t         playercount;
+    uint8_t         maxclients;
+    uint16_t        port;
+    char            ip[INET_ADDRSTRLEN];
+    char            map[20];
+    char            name[50];
+    char            players[PLAYERLIST_CHARS];  // names, comma separated, cut short
+    q2_server_t     *server;        // everything else
+} server_info_t;
+
 
 /**
  * Represents a server record in the database. For speed sake, these records are
  * loaded into these structures. When user updates the website, these are reloaded
  */
 struct q2_server_s {
-    uint32_t        index;          // the "i" in poll's socket array
     bool            connected;
-    uint32_t        socket;
+    int             socket;
     connection_t    connection;
     uint32_t        id;             // primary key in database table
     uint32_t        key;            // auth key, sent with every msg
@@ -200,15 +485,16 @@ struct q2_server_s {
     long            lastcontact;    // when did we last see this server?
     bool            enabled;        // owner wants it used
     msg_buffer_t    msg;            // sending
-    msg_buffer_t    msg_in;         // receiving
-    q2_player_t     players[256];
+    player_table_t  *players;       // allocated when it first connects
+    bool            players_changed;    // names to publish again
     bool            trusted;        // auth'd, identity confirmed
     RSA             *publickey;
-    list_t          entry;
+    server_info_t   *info;          // in the registry
+    list_t          reactor_entry;  // in the owning reactor's server list
+    bool            flush;          // msg has output waiting for FlushBuffers()
+    list_t          flush_entry;    // in the owning reactor's flush list
 };
 
-typedef struct q2_server_s q2_server_t;
-
 
 /**
  * Means of death.
@@ -318,12 +604,15 @@ typedef enum {
 
 q2a_config_t config;
 sqlite3 *db;
-extern list_t q2srvlist;
-extern struct pollfd *sockets;
-extern uint32_t socket_size;
-extern uint32_t socket_count;
+extern server_info_t *registry;
+extern uint32_t registry_count;
+extern pthread_mutex_t q2srvlock;
 extern threadpool pool;
+extern reactor_t reactors[MAX_REACTORS];
+extern volatile sig_atomic_t reload_keys;
+extern volatile sig_atomic_t shutting_down;
 
+const byte  *MSG_ReadSpan(msg_buffer_t *msg, size_t len);
 void        MSG_ReadData(msg_buffer_t *msg, void *out, size_t len);
 uint8_t     MSG_ReadByte(msg_buffer_t *msg);
 int8_t      MSG_ReadChar(msg_buffer_t *msg);
@@ -331,14 +620,22 @@ uint16_t    MSG_ReadShort(msg_buffer_t *msg);
 int16_t     MSG_ReadWord(msg_buffer_t *msg);
 int32_t     MSG_ReadLong(msg_buffer_t *msg);
 char        *MSG_ReadString(msg_buffer_t *msg);
+msg_string_t MSG_ReadStringView(msg_buffer_t *msg);
+size_t      MSG_CopyString(msg_string_t s, char *out, size_t size, bool strip);
 
+byte        *MSG_WriteSpan(msg_buffer_t *buf, size_t len);
 void        MSG_WriteByte(uint8_t b, msg_buffer_t *buf);
 void        MSG_WriteShort(uint16_t s, msg_buffer_t *buf);
 void        MSG_WriteLong(uint32_t l, msg_buffer_t *buf);
 void        MSG_WriteString(const char *str, msg_buffer_t *buf);
 void        MSG_WriteData(const void *data, size_t length, msg_buffer_t *buf);
+bool        MSG_Reserve(msg_buffer_t *buf, size_t size);
+void        MSG_Release(msg_buffer_t *buf);
 
 void        SendBuffer(q2_server_t *srv);
+bool        SendFrame(connection_t *c, msg_buffer_t *msg, bool closing);
+bool        SendRaw(connection_t *c, msg_buffer_t *msg);
+void        FlushBuffers(reactor_t *r);
 
 void        CMD_Teleport_f(q2_server_t *srv);
 void        CMD_Register_f(q2_server_t *srv);
@@ -347,9 +644,15 @@ void        CMD_PlayerConnect_f(q2_server_t *srv);
 void        CMD_PlayerDisconnect_f(q2_server_t *srv);
 
 void        CloseConnection(q2_server_t *srv);
+void        ResumeConnection(connection_t *c);
+void        DropConnection(connection_t *c);
+void        InvalidClient(connection_t *c);
+void        EndPending(connection_t *c);
 
 q2_server_t *find_server(uint32_t key);
-q2_server_t *find_server_by_name(const char *name);
+server_info_t *find_server_by_name(const char *name, size_t len);
+void        IndexServers(void);
+void        PublishServer(q2_server_t *srv);
 
 void        *ServerThread(void *arg);
 
@@ -371,30 +674,67 @@ void        ParsePlayerUpdate(q2_server_t *srv, msg_buffer_t *in);
 void        ParsePlayerDisconnect(q2_server_t *srv, msg_buffer_t *in);
 void        ParseMap(q2_server_t *srv, msg_buffer_t *in);
 void        ParsePlayerList(q2_server_t *srv, msg_buffer_t *in);
-void        ParseHello(hello_t *h, msg_buffer_t *in);
+bool        ParseHello(hello_t *h, msg_buffer_t *in);
 void        ParseAuth(q2_server_t *q2, msg_buffer_t *in);
-void        ParsePeerRequest(msg_buffer_t *in, uint32_t index);
+bool        ParsePeerRequest(msg_buffer_t *in, connection_t *c);
 
 void        *ClientThread(void *arg);
 void        CL_HandleInput(gchar **in);
 
+// arena.c
+void        *ARENA_Alloc(size_t len);
+void        ARENA_Shrink(void *p, size_t len);
+char        *ARENA_Strdup(const char *str);
+arena_mark_t ARENA_Mark(void);
+void        ARENA_Reset(arena_mark_t m);
+
+// broadcast.c
+void        Broadcast(reactor_t *origin, const byte *data, size_t len);
+void        BroadcastSay(reactor_t *origin, const char *text);
+
 // crypto.c
 void        Client_PublicKey_Encypher(q2_server_t *q2, byte *to, byte *from, int *len);
 size_t      Client_Challenge_Decrypt(q2_server_t *q2, byte *to, byte *from);
 uint32_t    Server_PrivateKey_Encypher(byte *to, byte *from);
 uint32_t    Server_PrivateKey_Decypher(byte *to, byte *from);
 
+bool        LoadPrivateKey(void);
 size_t      Sign_Client_Challenge(byte *to, byte *from);
+RSA         *GetClientPublicKey(uint32_t key);
+void        PrewarmPublicKeys(void);
 size_t      Encrypt_AESKey(RSA *publickey, byte *key, byte *iv, byte *cipher);
 void        hexDump (char *desc, void *addr, int len);
-size_t      SymmetricDecrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len);
-size_t      SymmetricEncrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len);
+ssize_t     SymmetricDecrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len);
+ssize_t     SymmetricEncrypt(q2_server_t *q2, byte *dest, byte *src, size_t src_len);
+bool        SymmetricInit(q2_server_t *q2);
+
+// handshake.c
+bool        ServerAuthResponse(q2_server_t *q2, byte *challenge);
 bool        VerifyClientChallenge(q2_server_t *q2, msg_buffer_t *msg);
+void        AuthFailed(q2_server_t *q2);
 
 // database.c
 void        OpenDatabase(void);
 void        CloseDatabase(void);
 
+// timer.c
+void        TIMER_Init(timer_wheel_t *w, uint64_t now);
+void        TIMER_Set(timer_wheel_t *w, q2_timer_t *t, uint64_t when, void (*func)(void *arg), void *arg);
+void        TIMER_Cancel(timer_wheel_t *w, q2_timer_t *t);
+void        TIMER_Move(q2_timer_t *to, q2_timer_t *from);
+void        TIMER_Run(timer_wheel_t *w, uint64_t now);
+int         TIMER_Timeout(timer_wheel_t *w, uint64_t now);
+
+// player.c
+q2_player_t *PL_Add(q2_server_t *srv, uint8_t id, const char *userinfo);
+q2_player_t *PL_Get(q2_server_t *srv, uint8_t id);
+q2_player_t *PL_Next(q2_server_t *srv, q2_player_t *p);
+void        PL_Remove(q2_server_t *srv, uint8_t id);
+void        PL_Clear(q2_server_t *srv);
+msg_string_t PL_Info(const q2_player_t *p, info_key_t key);
+const char  *PL_Intern(const char *str);
+void        PL_Release(const char *str);
+
 // util.c
 void        hexDump (char *desc, void *addr, int len);
 char        *Info_ValueForKey(char *s, char *key);
@@ -404,7 +744,35 @@ void        TestThreading(void *arg);
 char        *va(const char *format, ...);
 void        ClientText(q2_server_t *srv, uint8_t cl, uint32_t type, char *text);
 char        *BuildTeleportServers(void);
+uint64_t    Milliseconds(void);
+uint64_t    Microseconds(void);
+void        PrintStats(reactor_t *r);
+
+// event.c
+ev_loop_t   *EV_CreateLoop(void);
+bool        EV_Add(ev_loop_t *ev, int fd, uint32_t events, void *data);
+bool        EV_Modify(ev_loop_t *ev, int fd, uint32_t events, void *data);
+void        EV_Remove(ev_loop_t *ev, int fd);
+int         EV_Wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout);
+ssize_t     EV_Send(ev_loop_t *ev, int fd, const byte *data, size_t len);
+ssize_t     EV_Sendv(ev_loop_t *ev, int fd, const struct iovec *iov, int count);
+bool        EV_Sending(ev_loop_t *ev, int fd);
+void        EV_Post(ev_loop_t *ev, void (*func)(void *arg), void *arg);
+void        EV_Wake(ev_loop_t *ev);
+const char  *EV_BackendName(ev_loop_t *ev);
+
+// uring.c
+#if USE_IO_URING
+uring_t     *URING_Create(void);
+void        URING_Free(uring_t *u);
+bool        URING_Add(uring_t *u, int fd, uint32_t events, void *data);
+void        URING_Modify(uring_t *u, int fd, uint32_t events, void *data);
+void        URING_Remove(uring_t *u, int fd);
+ssize_t     URING_Send(uring_t *u, int fd, const struct iovec *iov, int count);
+bool        URING_Sending(uring_t *u, int fd);
+int         URING_Wait(uring_t *u, ev_event_t *out, int max, int timeout);
+#endif
 
 // peer.c
-void        P_GetServerList(uint32_t index);
+bool        P_GetServerList(connection_t *c);
 #endif
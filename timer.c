@@ -0,0 +1,250 @@
+#include "server.h"
+
+/**
+ * Hierarchical timer wheel. Each reactor has one for the handshake
+ * deadlines and idle timeouts of its connections, plus any periodic jobs.
+ *
+ * Time is counted in TIMER_TICK ms ticks. Level 0 has a slot for each of
+ * the next 64 ticks, level 1 a slot for each of the next 64 spans of 64
+ * ticks, and so on. A timer goes in the lowest level that reaches its
+ * deadline. Whenever level 0 wraps around, the next slot up is emptied
+ * and its timers sorted back down (a cascade), so a timer is only ever
+ * touched a handful of times no matter how far off it is.
+ *
+ * Timers are embedded in whatever they belong to, so setting and
+ * cancelling one is just linking or unlinking a list entry. Nothing is
+ * locked, only the owning reactor uses its wheel.
+ */
+
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_SPAN(l)   (1ULL << (TIMER_BITS * (l)))    // ticks per slot at level l
+
+
+/**
+ * Move every timer in a slot onto the end of another list
+ */
+static void take_slot(timer_wheel_t *w, uint32_t level, uint32_t slot, list_t *to)
+{
+    list_t *head = &w->slots[level][slot];
+
+    w->used[level] &= ~(1ULL << slot);
+
+    if (LIST_EMPTY(head)) {
+        return;
+    }
+
+    head->next->prev = to->prev;
+    to->prev->next = head->next;
+    head->prev->next = to;
+    to->prev = head->prev;
+    List_Init(head);
+}
+
+
+/**
+ * File the timer in the slot for its deadline
+ */
+static void wheel_add(timer_wheel_t *w, q2_timer_t *t)
+{
+    uint64_t delta;
+    uint32_t level, slot;
+
+    // overdue, run it next tick
+    if (t->expires < w->tick) {
+        t->expires = w->tick;
+    }
+
+    delta = t->expires - w->tick;
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < TIMER_SPAN(level + 1)) {
+            break;
+        }
+    }
+
+    // further out than the wheel reaches, it'll wait as long as it can
+    if (delta >= TIMER_SPAN(TIMER_LEVELS)) {
+        t->expires = w->tick + TIMER_SPAN(TIMER_LEVELS) - 1;
+    }
+
+    slot = (t->expires >> (TIMER_BITS * level)) & TIMER_MASK;
+    List_Append(&w->slots[level][slot], &t->entry);
+    w->used[level] |= 1ULL << slot;
+}
+
+
+/**
+ * Sort the timers in a higher level slot back down now that they're closer
+ */
+static void cascade(timer_wheel_t *w, uint32_t level, uint32_t slot)
+{
+    list_t pending;
+    q2_timer_t *t;
+
+    List_Init(&pending);
+    take_slot(w, level, slot, &pending);
+
+    while (!LIST_EMPTY(&pending)) {
+        t = LIST_FIRST(q2_timer_t, &pending, entry);
+        List_Delete(&t->entry);
+        wheel_add(w, t);
+    }
+}
+
+
+/**
+ * Start an empty wheel at the current time (ms)
+ */
+void TIMER_Init(timer_wheel_t *w, uint64_t now)
+{
+    uint32_t i, j;
+
+    memset(w, 0, sizeof(timer_wheel_t));
+
+    for (i=0; i<TIMER_LEVELS; i++) {
+        for (j=0; j<TIMER_SLOTS; j++) {
+            List_Init(&w->slots[i][j]);
+        }
+    }
+
+    w->tick = now / TIMER_TICK;
+}
+
+
+/**
+ * Call func(arg) once the clock reaches `when` (ms). Setting a timer
+ * that's already running moves it.
+ */
+void TIMER_Set(timer_wheel_t *w, q2_timer_t *t, uint64_t when, void (*func)(void *arg), void *arg)
+{
+    TIMER_Cancel(w, t);
+
+    t->expires = (when + TIMER_TICK - 1) / TIMER_TICK;
+    t->func = func;
+    t->arg = arg;
+    t->active = true;
+    w->count++;
+
+    wheel_add(w, t);
+}
+
+
+/**
+ * Stop a timer from going off. Fine to call on one that isn't running.
+ */
+void TIMER_Cancel(timer_wheel_t *w, q2_timer_t *t)
+{
+    if (!t->active) {
+        return;
+    }
+
+    List_Delete(&t->entry);
+    t->active = false;
+    w->count--;
+}
+
+
+/**
+ * The timer's owner is moving in memory, take its place in the wheel
+ */
+void TIMER_Move(q2_timer_t *to, q2_timer_t *from)
+{
+    *to = *from;
+
+    if (from->active) {
+        List_Insert(&from->entry, &to->entry);
+        List_Delete(&from->entry);
+        from->active = false;
+    }
+}
+
+
+/**
+ * Run every timer due by now (ms). Callbacks are free to set and cancel
+ * timers, including their own.
+ */
+void TIMER_Run(timer_wheel_t *w, uint64_t now)
+{
+    uint64_t target = now / TIMER_TICK;
+    uint32_t level, slot;
+    list_t due;
+    q2_timer_t *t;
+
+    // nothing to catch up on
+    if (!w->count) {
+        if (w->tick <= target) {
+            w->tick = target + 1;
+        }
+        return;
+    }
+
+    List_Init(&due);
+
+    while (w->tick <= target) {
+        slot = w->tick & TIMER_MASK;
+
+        // level 0 wrapped, bring the next span down. Keep going up while
+        // each level wraps too
+        if (!slot) {
+            for (level = 1; level < TIMER_LEVELS; level++) {
+                cascade(w, level, (w->tick >> (TIMER_BITS * level)) & TIMER_MASK);
+                if ((w->tick >> (TIMER_BITS * level)) & TIMER_MASK) {
+                    break;
+                }
+            }
+        }
+
+        take_slot(w, 0, slot, &due);
+        w->tick++;
+
+        while (!LIST_EMPTY(&due)) {
+            t = LIST_FIRST(q2_timer_t, &due, entry);
+            List_Delete(&t->entry);
+            t->active = false;
+            w->count--;
+            t->func(t->arg);
+        }
+    }
+}
+
+
+/**
+ * How long the event loop can wait (ms) before TIMER_Run() has something
+ * to do. Timers beyond level 0 are picked up at the next cascade, so the
+ * loop wakes at least every 64 ticks while any are set.
+ */
+int TIMER_Timeout(timer_wheel_t *w, uint64_t now)
+{
+    uint32_t start = w->tick & TIMER_MASK;
+    uint64_t bits, due;
+    uint32_t n;
+
+    if (!w->count) {
+        return POLL_BLOCK;
+    }
+
+    // on the wrap itself the cascade hasn't happened yet, otherwise only
+    // look this side of it, the rest may still get earlier timers
+    // cascaded in
+    due = (start) ? (w->tick | TIMER_MASK) + 1 : w->tick;
+    bits = (start) ? w->used[0] >> start : 0;
+
+    while (bits) {
+        n = __builtin_ctzll(bits);
+
+        if (!LIST_EMPTY(&w->slots[0][start + n])) {
+            due = w->tick + n;
+            break;
+        }
+
+        // emptied by TIMER_Cancel()
+        w->used[0] &= ~(1ULL << (start + n));
+        bits &= ~(1ULL << n);
+    }
+
+    if (due * TIMER_TICK <= now) {
+        return 0;
+    }
+
+    return (int) (due * TIMER_TICK - now);
+}
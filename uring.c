@@ -0,0 +1,864 @@
+#define _GNU_SOURCE     // syscall(), MAP_ANONYMOUS, MAP_POPULATE
+#include "server.h"
+
+/**
+ * io_uring transport. Instead of waiting for sockets to become ready and
+ * then calling recv/send on each one, the kernel accepts connections and
+ * receives data on its own and we just reap the completions:
+ *
+ * - one multishot accept on the listener produces every new connection
+ * - each client socket has a multishot recv armed, drawing from a ring
+ *   of buffers we provide up front
+ * - sends are queued as submissions and pushed to the kernel in a single
+ *   syscall once per trip around the event loop. A socket has one send
+ *   in the kernel at a time and the rest wait behind it, so a short send
+ *   is finished before anything after it goes out. Each socket can have
+ *   URING_SNDBUF bytes queued, after that sends fail with EAGAIN like a
+ *   full socket buffer and EV_WRITE is reported once some complete
+ * - anything that can't get a submission entry right away (a send, or
+ *   the cancel for a removed socket's recv) is retried at the start of
+ *   the next turn rather than failed
+ *
+ * Talks to the kernel directly rather than through liburing so there's
+ * nothing extra to install. Needs Linux 5.19 or newer for provided buffer
+ * rings, otherwise URING_Create() fails and the regular epoll/poll
+ * backend is used instead.
+ */
+
+#if USE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES   256
+#define URING_BUFFERS   256             // must be a power of 2
+#define URING_BUFSIZE   (16 * 1024)
+#define URING_BGID      0
+#define URING_SNDBUF    (256 * 1024)    // bytes in flight per socket
+
+typedef enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+} uring_optype_t;
+
+/**
+ * Every submission carries one of these in its user_data
+ */
+typedef struct uring_op_s {
+    uring_optype_t  type;
+    int             fd;
+    uint32_t        gen;        // which incarnation of the socket
+    void            *data;      // connection, NULL once removed
+    bool            armed;      // recv still outstanding in the kernel
+    bool            cancelling; // removed, waiting for an entry to cancel the recv
+    bool            want_write; // report EV_WRITE when sends complete
+    size_t          queued;     // send bytes waiting or in flight for this socket
+    struct uring_op_s *sendq;   // sends for this socket, the first is in the kernel
+    struct uring_op_s *sendq_tail;
+    bool            stalled;    // first send couldn't get a submission entry
+    struct uring_op_s *next;    // next send queued on the same socket, or next in u->cancels
+    byte            *buf;       // send payload
+    size_t          len;
+    size_t          sent;
+} uring_op_t;
+
+struct uring_s {
+    int             fd;
+
+    void            *sq_ring;
+    size_t          sq_ring_size;
+    unsigned        *sq_head;
+    unsigned        *sq_tail;
+    unsigned        *sq_mask;
+    unsigned        *sq_array;
+    unsigned        sq_entries;
+    unsigned        sq_pending;     // queued but not yet handed to the kernel
+    struct io_uring_sqe *sqes;
+    size_t          sqes_size;
+
+    void            *cq_ring;
+    size_t          cq_ring_size;
+    unsigned        *cq_head;
+    unsigned        *cq_tail;
+    unsigned        *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    size_t          br_size;
+    byte            *bufs;
+    uint16_t        br_tail;
+    uint16_t        recycle[URING_BUFFERS];  // handed out during the last turn
+    uint32_t        recycle_count;
+
+    uring_op_t      **socks;        // recv op for each socket, indexed by fd
+    uint32_t        socks_size;
+    uint32_t        gen;
+
+    uring_op_t      accept;
+    bool            multishot_recv;
+    bool            stalled;        // some socket's sends need rearming
+    uring_op_t      *cancels;       // removed sockets whose recv still needs cancelling
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+
+/**
+ * Hand all queued submissions to the kernel without waiting
+ */
+static void uring_submit(uring_t *u)
+{
+    int ret;
+
+    while (u->sq_pending) {
+        ret = uring_enter(u->fd, u->sq_pending, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[error] io_uring_enter");
+            return;
+        }
+        u->sq_pending -= ret;
+    }
+}
+
+
+/**
+ * Get the next free submission entry. If the queue is full, flush it to
+ * the kernel first.
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+    unsigned head, tail, index;
+    struct io_uring_sqe *sqe;
+
+    tail = *u->sq_tail;
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= u->sq_entries) {
+        uring_submit(u);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= u->sq_entries) {
+            return NULL;
+        }
+    }
+
+    index = tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+
+    return sqe;
+}
+
+
+/**
+ * Give a receive buffer back to the kernel
+ */
+static void uring_add_buffer(uring_t *u, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &u->br->bufs[u->br_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (u->bufs + (bid * URING_BUFSIZE));
+    buf->len = URING_BUFSIZE;
+    buf->bid = bid;
+    u->br_tail++;
+}
+
+static void uring_publish_buffers(uring_t *u)
+{
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+
+static void uring_arm_accept(uring_t *u)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (!sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->accept.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t) (uintptr_t) &u->accept;
+}
+
+
+static void uring_arm_recv(uring_t *u, uring_op_t *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (!sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = op->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = (u->multishot_recv) ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = (uint64_t) (uintptr_t) op;
+    op->armed = true;
+}
+
+
+/**
+ * Hand the rest of a send to the kernel. False if there's no submission
+ * entry for it right now.
+ */
+static bool uring_arm_send(uring_t *u, uring_op_t *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (!sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (op->buf + op->sent);
+    sqe->len = op->len - op->sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) op;
+
+    return true;
+}
+
+
+/**
+ * Start the socket's next send, if it has one. If there's no room in the
+ * submission queue it's retried at the start of the next turn, see
+ * uring_resume_sends().
+ */
+static void uring_next_send(uring_t *u, uring_op_t *sock)
+{
+    sock->stalled = sock->sendq && !uring_arm_send(u, sock->sendq);
+    if (sock->stalled) {
+        u->stalled = true;
+    }
+}
+
+
+/**
+ * Retry the sends that couldn't get a submission entry
+ */
+static void uring_resume_sends(uring_t *u)
+{
+    uint32_t i;
+
+    u->stalled = false;
+    for (i=0; i<u->socks_size; i++) {
+        if (u->socks[i] && u->socks[i]->stalled) {
+            uring_next_send(u, u->socks[i]);
+        }
+    }
+}
+
+
+/**
+ * Cancel a removed socket's outstanding recv, which otherwise keeps the
+ * closed file open. If there's no submission entry for it right now it
+ * waits in u->cancels for the next turn.
+ */
+static void uring_cancel_recv(uring_t *u, uring_op_t *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (!sqe) {
+        op->cancelling = true;
+        op->next = u->cancels;
+        u->cancels = op;
+        return;
+    }
+
+    op->cancelling = false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) op;
+    sqe->user_data = 0;
+}
+
+
+/**
+ * Retry the cancels that couldn't get a submission entry. A recv that
+ * finished on its own in the meantime has nothing left to cancel.
+ */
+static void uring_resume_cancels(uring_t *u)
+{
+    uring_op_t *op, *next;
+
+    op = u->cancels;
+    u->cancels = NULL;
+
+    for (; op; op = next) {
+        next = op->next;
+        if (op->armed) {
+            uring_cancel_recv(u, op);
+        } else {
+            free(op);
+        }
+    }
+}
+
+
+/**
+ * Throw away a socket's sends that haven't reached the kernel. The first
+ * one is left alone if it's in flight, its completion frees it.
+ */
+static void uring_drop_sends(uring_op_t *sock)
+{
+    uring_op_t *op, *next;
+
+    op = sock->sendq;
+    if (op && !sock->stalled) {
+        op = op->next;
+    }
+
+    for (; op; op = next) {
+        next = op->next;
+        free(op->buf);
+        free(op);
+    }
+
+    sock->sendq = sock->sendq_tail = NULL;
+    sock->stalled = false;
+}
+
+
+static void uring_free(uring_t *u)
+{
+    uring_op_t *op, *next;
+
+    // closing the ring cancels whatever's left in the kernel
+    for (op = u->cancels; op; op = next) {
+        next = op->next;
+        free(op);
+    }
+
+    if (u->br) {
+        munmap(u->br, u->br_size);
+    }
+
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+
+    if (u->cq_ring && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+
+    if (u->sq_ring) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+
+    free(u->bufs);
+    free(u->socks);
+    free(u);
+}
+
+
+/**
+ * Tear down the rings of a loop that's not going to run
+ */
+void URING_Free(uring_t *u)
+{
+    uring_free(u);
+}
+
+
+/**
+ * Set up the rings. Returns NULL if the kernel can't do what we need,
+ * the caller should fall back to readiness-based I/O.
+ */
+uring_t *URING_Create(void)
+{
+    uring_t *u;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    char *ring;
+    uint16_t i;
+
+    u = malloc(sizeof(uring_t));
+    memset(u, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0) {
+        printf("[warn] io_uring unavailable: %s\n", strerror(errno));
+        free(u);
+        return NULL;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        printf("[warn] io_uring: kernel too old\n");
+        uring_free(u);
+        return NULL;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_ring_size > u->sq_ring_size) {
+        u->sq_ring_size = u->cq_ring_size;
+    }
+    u->cq_ring_size = u->sq_ring_size;
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        uring_free(u);
+        return NULL;
+    }
+    u->cq_ring = u->sq_ring;
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        uring_free(u);
+        return NULL;
+    }
+
+    ring = u->sq_ring;
+    u->sq_head = (unsigned *) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+
+    ring = u->cq_ring;
+    u->cq_head = (unsigned *) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+    // the provided buffer ring has to be page aligned
+    u->br_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        uring_free(u);
+        return NULL;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        printf("[warn] io_uring: no provided buffer rings (%s)\n", strerror(errno));
+        uring_free(u);
+        return NULL;
+    }
+
+    u->bufs = malloc(URING_BUFFERS * URING_BUFSIZE);
+    for (i=0; i<URING_BUFFERS; i++) {
+        uring_add_buffer(u, i);
+    }
+    uring_publish_buffers(u);
+
+    u->socks_size = 256;
+    u->socks = malloc(u->socks_size * sizeof(uring_op_t *));
+    memset(u->socks, 0, u->socks_size * sizeof(uring_op_t *));
+
+    u->multishot_recv = true;
+    u->accept.fd = -1;
+
+    return u;
+}
+
+
+/**
+ * Start watching a socket. Listeners get a multishot accept, everything
+ * else a recv.
+ */
+bool URING_Add(uring_t *u, int fd, uint32_t events, void *data)
+{
+    uring_op_t *op;
+
+    if (events & EV_ACCEPT) {
+        u->accept.type = URING_OP_ACCEPT;
+        u->accept.fd = fd;
+        uring_arm_accept(u);
+        return true;
+    }
+
+    if (fd >= u->socks_size) {
+        uint32_t size = u->socks_size;
+
+        while (fd >= size) {
+            size *= 2;
+        }
+
+        u->socks = realloc(u->socks, size * sizeof(uring_op_t *));
+        memset(u->socks + u->socks_size, 0, (size - u->socks_size) * sizeof(uring_op_t *));
+        u->socks_size = size;
+    }
+
+    op = malloc(sizeof(uring_op_t));
+    memset(op, 0, sizeof(uring_op_t));
+    op->type = URING_OP_RECV;
+    op->fd = fd;
+    op->gen = ++u->gen;
+    op->data = data;
+
+    u->socks[fd] = op;
+    uring_arm_recv(u, op);
+
+    return true;
+}
+
+
+void URING_Modify(uring_t *u, int fd, uint32_t events, void *data)
+{
+    // an accept that stopped on an error is started again
+    if (events & EV_ACCEPT) {
+        if (fd == u->accept.fd) {
+            uring_arm_accept(u);
+        }
+        return;
+    }
+
+    if (fd < u->socks_size && u->socks[fd]) {
+        u->socks[fd]->data = data;
+        u->socks[fd]->want_write = (events & EV_WRITE) != 0;
+    }
+}
+
+
+/**
+ * Stop watching a socket. The caller is about to close it, so the send in
+ * flight goes to the kernel now while the descriptor is still valid,
+ * followed by a cancel for the outstanding recv. Sends still waiting
+ * behind it are dropped, like a full socket buffer being closed.
+ */
+void URING_Remove(uring_t *u, int fd)
+{
+    uring_op_t *op;
+
+    if (fd >= u->socks_size || !u->socks[fd]) {
+        return;
+    }
+
+    op = u->socks[fd];
+    u->socks[fd] = NULL;
+    op->data = NULL;
+
+    // one last try for a first send that's still waiting for an entry
+    if (op->stalled) {
+        uring_next_send(u, op);
+    }
+    uring_drop_sends(op);
+
+    if (!op->armed) {
+        free(op);
+    } else {
+        uring_cancel_recv(u, op);
+    }
+
+    uring_submit(u);
+}
+
+
+/**
+ * Queue data to be sent, gathered from count pieces. The data is copied,
+ * it goes to the kernel behind anything already queued for the socket.
+ * Returns the length taken, or -1 with EAGAIN if the socket has too much
+ * queued.
+ */
+ssize_t URING_Send(uring_t *u, int fd, const struct iovec *iov, int count)
+{
+    uring_op_t *op, *sock;
+    size_t len = 0, off = 0;
+    int i;
+
+    if (fd < 0 || fd >= u->socks_size || !u->socks[fd]) {
+        errno = EBADF;
+        return -1;
+    }
+
+    sock = u->socks[fd];
+    if (sock->queued >= URING_SNDBUF) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        len += iov[i].iov_len;
+    }
+
+    op = malloc(sizeof(uring_op_t));
+    memset(op, 0, sizeof(uring_op_t));
+    op->type = URING_OP_SEND;
+    op->fd = fd;
+    op->gen = sock->gen;
+    op->buf = malloc(len);
+    op->len = len;
+    for (i = 0; i < count; i++) {
+        memcpy(op->buf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+
+    // nothing ahead of it, it goes straight to the kernel. Nothing would
+    // complete to say when to try again, so if there's no submission entry
+    // it's kept and started next turn instead of refused.
+    if (!sock->sendq) {
+        sock->sendq = op;
+        sock->sendq_tail = op;
+        uring_next_send(u, sock);
+    } else {
+        sock->sendq_tail->next = op;
+        sock->sendq_tail = op;
+    }
+
+    sock->queued += len;
+
+    return len;
+}
+
+
+/**
+ * True if the socket has sends queued or in flight
+ */
+bool URING_Sending(uring_t *u, int fd)
+{
+    return fd >= 0 && fd < u->socks_size && u->socks[fd] && u->socks[fd]->sendq;
+}
+
+
+/**
+ * Handle a single completion. Returns true if an event was produced.
+ */
+static bool uring_complete(uring_t *u, struct io_uring_cqe *cqe, ev_event_t *out)
+{
+    uring_op_t *op = (uring_op_t *) (uintptr_t) cqe->user_data;
+    uring_op_t *sock;
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    uint16_t bid;
+
+    if (!op) {
+        return false;   // cancel request
+    }
+
+    switch (op->type) {
+    case URING_OP_ACCEPT:
+        // it stopped on an error, the reactor decides when to start it
+        // again rather than have it fail over and over
+        if (cqe->res < 0 && !more) {
+            out->events = EV_ACCEPT;
+            out->fd = -1;
+            out->len = cqe->res;
+            return true;
+        }
+
+        if (!more) {
+            uring_arm_accept(u);
+        }
+
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            perror("[error] accept");
+            return false;
+        }
+
+        out->events = EV_ACCEPT;
+        out->fd = cqe->res;
+        out->data = NULL;
+        return true;
+
+    case URING_OP_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            u->recycle[u->recycle_count++] = bid;
+        } else {
+            bid = 0;
+        }
+
+        if (!more) {
+            op->armed = false;
+        }
+
+        // socket was removed, just waiting for the last completion. One
+        // still waiting to be cancelled is freed from the cancel list.
+        if (!op->data) {
+            if (!op->armed && !op->cancelling) {
+                free(op);
+            }
+            return false;
+        }
+
+        // kernel doesn't do multishot recv, fall back to one at a time
+        if (cqe->res == -EINVAL && u->multishot_recv) {
+            printf("[warn] io_uring: no multishot recv, using single recv\n");
+            u->multishot_recv = false;
+            uring_arm_recv(u, op);
+            return false;
+        }
+
+        // ran out of buffers, they'll be back before this is submitted
+        if (cqe->res == -ENOBUFS) {
+            uring_arm_recv(u, op);
+            return false;
+        }
+
+        if (cqe->res > 0 && !op->armed) {
+            uring_arm_recv(u, op);
+        }
+
+        out->events = EV_DATA;
+        out->fd = op->fd;
+        out->data = op->data;
+        out->buf = (cqe->res > 0) ? u->bufs + (bid * URING_BUFSIZE) : NULL;
+        out->len = cqe->res;
+        return true;
+
+    case URING_OP_SEND:
+        if (cqe->res > 0) {
+            op->sent += cqe->res;
+        }
+
+        // the socket might have been closed and the descriptor reused
+        sock = (op->fd < u->socks_size) ? u->socks[op->fd] : NULL;
+        if (sock && sock->gen != op->gen) {
+            sock = NULL;
+        }
+
+        // socket's gone, nothing else of it is queued
+        if (!sock) {
+            free(op->buf);
+            free(op);
+            return false;
+        }
+
+        // partial send, finish it before anything queued behind it
+        if (cqe->res > 0 && op->sent < op->len) {
+            uring_next_send(u, sock);
+            return false;
+        }
+
+        // done, or the socket broke and the recv side will report it
+        sock->sendq = op->next;
+        if (!sock->sendq) {
+            sock->sendq_tail = NULL;
+        }
+        sock->queued -= op->len;
+        free(op->buf);
+        free(op);
+
+        uring_next_send(u, sock);
+
+        if (!sock->want_write || sock->queued >= URING_SNDBUF) {
+            return false;
+        }
+
+        out->events = EV_WRITE;
+        out->fd = sock->fd;
+        out->data = sock->data;
+        return true;
+    }
+
+    return false;
+}
+
+
+/**
+ * Submit everything queued since the last turn and wait for completions.
+ * Receive buffers handed out last turn are assumed to be consumed by now
+ * and go back to the kernel first.
+ */
+int URING_Wait(uring_t *u, ev_event_t *out, int max, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, wait;
+    uint32_t i;
+    int ret, count = 0;
+
+    if (u->stalled) {
+        uring_resume_sends(u);
+    }
+
+    if (u->cancels) {
+        uring_resume_cancels(u);
+    }
+
+    if (u->recycle_count) {
+        for (i=0; i<u->recycle_count; i++) {
+            uring_add_buffer(u, u->recycle[i]);
+        }
+        u->recycle_count = 0;
+        uring_publish_buffers(u);
+    }
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    wait = (head == tail && timeout != 0) ? 1 : 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    ret = uring_enter(u->fd, u->sq_pending, wait,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0 && errno != EINTR && errno != ETIME) {
+        return -1;
+    }
+    if (ret > 0) {
+        u->sq_pending -= (ret > u->sq_pending) ? u->sq_pending : ret;
+    }
+
+    // every reaped recv can hold a buffer, don't take more than we can recycle
+    if (max > URING_BUFFERS) {
+        max = URING_BUFFERS;
+    }
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && count < max) {
+        memset(&out[count], 0, sizeof(ev_event_t));
+        if (uring_complete(u, &u->cqes[head & *u->cq_mask], &out[count])) {
+            count++;
+        }
+        head++;
+    }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+#endif
@@ -66,40 +66,38 @@ void hexDump (char *desc, void *addr, int len)
 }
 
 /**
- * Pick out a value for a given key in the userinfo string
+ * Pick out a value for a given key in the userinfo string. The value is
+ * copied to the thread's arena.
  */
 char *Info_ValueForKey(char *s, char *key)
 {
-    char pkey[512];
-    static char value[2][512]; // use two buffers so compares
-    // work without stomping on each other
-    static int valueindex;
-    char *o;
+    size_t keylen = strlen(key);
+    char *pkey, *value, *out;
+    size_t len;
 
-    valueindex ^= 1;
     if (*s == '\\')
         s++;
     while (1) {
-        o = pkey;
+        pkey = s;
         while (*s != '\\') {
             if (!*s)
                 return "";
-            *o++ = *s++;
+            s++;
         }
-        *o = 0;
+        len = s - pkey;
         s++;
 
-        o = value[valueindex];
-
+        value = s;
         while (*s != '\\' && *s) {
-            if (!*s)
-                return "";
-            *o++ = *s++;
+            s++;
         }
-        *o = 0;
 
-        if (!strcmp(key, pkey))
-            return value[valueindex];
+        if (len == keylen && !strncmp(key, pkey, len)) {
+            out = ARENA_Alloc(s - value + 1);
+            memcpy(out, value, s - value);
+            out[s - value] = 0;
+            return out;
+        }
 
         if (!*s)
             return "";
@@ -150,28 +148,98 @@ void SendError(q2_server_t *server, ra_error_t error, uint8_t id, const char *ms
 }
 
 
+/**
+ * Show what a reactor has been up to
+ */
+void PrintStats(reactor_t *r)
+{
+    printf("reactor %d: %llu bytes queued (peak %llu, total %llu), %u slow servers dropped\n",
+            r->id,
+            (unsigned long long) r->out_queued,
+            (unsigned long long) r->out_peak,
+            (unsigned long long) r->out_total,
+            r->slow_drops
+    );
+    printf("reactor %d: %llu frames sent, %llu messages coalesced\n",
+            r->id,
+            (unsigned long long) r->frames,
+            (unsigned long long) r->coalesced
+    );
+    printf("reactor %d: %llu connections accepted (%.1f/sec, peak %u per wakeup), %u accept errors\n",
+            r->id,
+            (unsigned long long) r->accepted,
+            r->accepted * 1000.0 / (Milliseconds() - r->started + 1),
+            r->accept_peak,
+            r->accept_errors
+    );
+    printf("reactor %d: %llu broadcasts (avg %.2f ms, peak %.2f ms to reach every server)\n",
+            r->id,
+            (unsigned long long) r->broadcasts,
+            (r->broadcasts) ? r->fanout_total / 1000.0 / r->broadcasts : 0.0,
+            r->fanout_peak / 1000.0
+    );
+    printf("reactor %d: %llu challenges signed (avg %.2f ms, peak %.2f ms)\n",
+            r->id,
+            (unsigned long long) r->signs,
+            (r->signs) ? r->sign_total / 1000.0 / r->signs : 0.0,
+            r->sign_peak / 1000.0
+    );
+    printf("reactor %d: %u timers set\n", r->id, r->timers.count);
+}
+
+
 /**
  * Catch things like ctrl+c to close open handles
  */
 void SignalCatcher(int sig)
 {
-    uint8_t i;
-    q2_server_t *srv;
+    uint32_t i;
 
-    // close all sockets and GTFO
+    // close all sockets and GTFO, once the reactors notice. Nothing else
+    // is safe to do from here
     if (sig == SIGINT) {
+        shutting_down = 1;
 
-        for (i=0; i<socket_count; i++) {
-            if (sockets[i].fd) {
-                close(sockets[i].fd);
+        for (i=0; i<config.reactors; i++) {
+            if (reactors[i].loop) {
+                EV_Wake(reactors[i].loop);
             }
         }
+        return;
+    }
 
-        CloseDatabase();
-        exit(EXIT_SUCCESS);
+    // not safe to do here, the first reactor picks it up
+    if (sig == SIGHUP) {
+        reload_keys = 1;
     }
 }
 
+/**
+ * A clock for timeouts, unaffected by changes to the system time
+ */
+uint64_t Milliseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Same clock, finer grained for timing things
+ */
+uint64_t Microseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
 /**
  * Just for testing threading
  */
@@ -185,68 +253,107 @@ void TestThreading(void *arg)
 }
 
 /**
- * Variable assignment, just makes building strings easier
+ * Variable assignment, just makes building strings easier. The string
+ * is in the thread's arena.
  */
 char *va(const char *format, ...)
 {
-    static char strings[8][MAX_STRING_CHARS];
-    static uint16_t index;
-
-    char *string = strings[index++ % 8];
-
+    char *string = ARENA_Alloc(MAX_STRING_CHARS);
     va_list args;
+    int len;
 
     va_start(args, format);
-    vsnprintf(string, MAX_STRING_CHARS, format, args);
+    len = vsnprintf(string, MAX_STRING_CHARS, format, args);
     va_end(args);
 
+    if (len >= 0 && len < MAX_STRING_CHARS) {
+        ARENA_Shrink(string, len + 1);
+    }
+
     return string;
 }
 
 /**
- * Add text to the message buffer for a particular client on a server
+ * Add text to the message buffer for a particular client on a server.
+ * Text longer than the client prints at once is split after a line break
+ * into as many messages as it takes. Each piece but the last is handed to
+ * SendBuffer() as it's written, so a long listing goes out over several
+ * frames instead of overflowing the buffer.
  */
 void ClientText(q2_server_t *srv, uint8_t cl, uint32_t type, char *text)
 {
-    MSG_WriteByte(SCMD_SAYCLIENT, &srv->msg);
-    MSG_WriteByte(cl, &srv->msg);
-    MSG_WriteByte(type, &srv->msg);
-    MSG_WriteString(text, &srv->msg);
+    size_t len = strlen(text), n;
+    byte *p;
+
+    do {
+        n = len;
+        if (n > MAX_STRING_CHARS - 1) {
+            n = MAX_STRING_CHARS - 1;
+
+            // end on the last whole line that fits, if there is one
+            while (n && text[n - 1] != '\n') {
+                n--;
+            }
+            if (!n) {
+                n = MAX_STRING_CHARS - 1;
+            }
+        }
+
+        p = MSG_WriteSpan(&srv->msg, 3 + n + 1);
+        if (!p) {
+            return;
+        }
+
+        p[0] = SCMD_SAYCLIENT;
+        p[1] = cl;
+        p[2] = type;
+        memcpy(p + 3, text, n);
+        p[3 + n] = 0;
+
+        text += n;
+        len -= n;
+
+        if (len) {
+            SendBuffer(srv);
+        }
+    } while (len);
 }
 
 /**
- * Build a string of all available servers
+ * Build a string of all available servers, in the thread's arena. Only
+ * the registry is read, the servers themselves belong to other reactors.
  */
 char *BuildTeleportServers(void)
 {
-    q2_server_t *server;
-    static char *str;
+    server_info_t *server;
+    char *str;
     char line[100];
-    char players[300];
-    uint16_t index = 0;
-    uint8_t i;
+    size_t len = 1, size = 2;
+
+    FOR_EACH_SERVER(server) {
+        if (server->trusted) {
+            size += sizeof(line);
+        }
+    }
 
-    str = "\n";
+    str = ARENA_Alloc(size);
+    strcpy(str, "\n");
 
     FOR_EACH_SERVER(server) {
         if (!server->trusted) {
             continue;
         }
 
-        memset(players, 0, sizeof(players));
-        memset(line, 0, sizeof(line));
-
-        // collect player names
-        for (i=0; i<server->playercount; i++) {
-            strcat(players, va("%s, ", server->players[i].name));
+        // one became trusted since we counted
+        if (size - len <= sizeof(line)) {
+            break;
         }
 
-        // remove the last comma and space
-        players[strlen(players) - 2] = 0;
-
-        snprintf(line, sizeof(line), "%-17s %s (%d/%d) %s", server->name, server->map, server->playercount, server->maxclients, players);
-        str = va("%s%s\n", str, line);
+        snprintf(line, sizeof(line), "%-17s %s (%d/%d) %s", server->name, server->map, server->playercount, server->maxclients, server->players);
+        len += snprintf(str + len, size - len, "%s\n", line);
     }
 
+    ARENA_Shrink(str, len + 1);
+
     return str;
 }